@@ -33,6 +33,9 @@
 #include "methyl/context.h"
 #include "methyl/node.h"
 #include "methyl/tree.h"
+#include "methyl/nodeview.h"
+#include "methyl/ranges.h"
+#include "methyl/traversal.h"
 
 // Don't want a dependency on the engine.h file in node.h
 // Have to do some acrobatics to get around that
@@ -67,33 +70,12 @@ namespace std {
             methyl::Tree<T> const & nodeRef
         ) const
         {
-            // This algorithm is a placeholder, and needs serious improvement.
+            // Each node caches the hash of its subtree, so this is usually
+            // just a load.  See NodePrivate::subtreeHash.
             //
             // https://github.com/hostilefork/methyl/issues/32
 
-            methyl::NodePrivate const & nodePrivate
-                = nodeRef.accessor().nodePrivate();
-
-            size_t result = 0;
-            int const N = -1; // For now, let's do full equality...
-            int i = 0;
-
-            std::hash<methyl::Tag> tagHasher;
-
-            methyl::NodePrivate const * current = &nodePrivate;
-            while (current and (i++ < N)) {
-                // Qt will not support std::hash until at least 2015
-                // https://bugreports.qt-project.org/browse/QTBUG-33428
-
-                if (current->hasText()) {
-                    result ^= qHash(current->text(HERE));
-                } else {
-                    result ^= tagHasher(current->tag(HERE));
-                }
-                current = current->maybeNextPreorderNodeUnderRoot(nodePrivate);
-            }
-
-            return result;
+            return nodeRef.accessor().nodePrivate().subtreeHash();
         }
     };
 }
@@ -128,6 +110,7 @@ private:
     mutable shared_ptr<Context> _contextDoNotUseDirectly;
 template <class> friend class Node;
 template <class> friend class Tree;
+template <class> friend class NodeView;
 
     // only called by NodeRef.  The reason this is not passed in
     // the constructor is because it would have to come via
@@ -183,8 +166,22 @@ private:
         );
     }
 
-    // Accessor extraction--for friend internal classes only
+    // Accessor extraction--for friend internal classes only.  If the node
+    // is a deferred clone, it gets filled in before anyone can look at it.
     NodePrivate & nodePrivate () {
+        NodePrivate & result = nodePrivateAsIs();
+        result.materialize();
+        return result;
+    }
+
+    NodePrivate const & nodePrivate () const {
+        NodePrivate const & result = nodePrivateAsIs();
+        result.materialize();
+        return result;
+    }
+
+    // For moving, freeing, and cloning, which don't need the contents
+    NodePrivate & nodePrivateAsIs () {
         checkValid();
 
         static auto nullNodePrivateCodeplace = HERE;
@@ -193,7 +190,7 @@ private:
         return *_nodePrivateDoNotUseDirectly;
     }
 
-    NodePrivate const & nodePrivate () const {
+    NodePrivate const & nodePrivateAsIs () const {
         checkValid();
 
         static auto nullNodePrivateCodeplace = HERE;
@@ -333,7 +330,7 @@ public:
     }
 
     Label labelInParent (codeplace const & cp) const {
-        Label result = labelInParent(cp);
+        Label result = nodePrivate().labelInParent(cp);
 
         Observer::current().labelInParent(result, nodePrivate());
         return result;
@@ -341,11 +338,13 @@ public:
 
     template <class T>
     bool hasParentEqualTo (Node<T> possibleParent) const {
-        // should be a finer-grained micro-observation than this
-        auto parent = maybeParent();
-        if (not parent)
-            return false;
-        return *parent == possibleParent;
+        NodePrivate const & thisNode = nodePrivate();
+        NodePrivate const & parentNode = possibleParent.accessor().nodePrivate();
+
+        bool result = thisNode.hasParent()
+            and thisNode.parent(HERE) == parentNode;
+        Observer::current().hasParentEqualTo(result, thisNode, parentNode);
+        return result;
     }
 
     bool hasLabelInParentEqualTo (
@@ -353,9 +352,11 @@ public:
         codeplace const & cp
     ) const
     {
-        // should be a finer-grained observation than this
-        Label label = labelInParent(cp);
-        return label == possibleLabel;
+        bool result = nodePrivate().labelInParent(cp) == possibleLabel;
+        Observer::current().hasLabelInParentEqualTo(
+            result, nodePrivate(), possibleLabel
+        );
+        return result;
     }
 
     // Is the right term "direct child" or "immediate child"?
@@ -385,17 +386,19 @@ public:
     }
 
     optional<Node<Accessor const>> maybeLookupTagNode() const {
-        if (not hasTag())
-            return nullopt;
+        NodePrivate const & thisNode = nodePrivate();
 
-        optional<Identity> id = tag(HERE).maybeAsIdentity();
-        if (not id)
-            return nullopt;
+        NodePrivate const * tagNode = nullptr;
+        if (thisNode.hasTag()) {
+            optional<Identity> id = thisNode.tag(HERE).maybeAsIdentity();
+            if (id)
+                tagNode = NodePrivate::maybeGetFromId(*id);
+        }
+
+        Observer::current().tryGetTagNode(tagNode, thisNode);
 
-        auto tagNode = NodePrivate::maybeGetFromId(*id);
         if (not tagNode)
             return nullopt;
-
         return Node<Accessor const>(*tagNode, context());
     }
 
@@ -405,11 +408,11 @@ public:
     }
 
     bool hasTagEqualTo (Tag const & possibleTag) const {
-        // should be a finer-grained observation than this
-        if (not hasTag())
-            return false;
+        NodePrivate const & thisNode = nodePrivate();
 
-        return tag(HERE) == possibleTag;
+        bool result = thisNode.hasTag() and thisNode.tag(HERE) == possibleTag;
+        Observer::current().hasTagEqualTo(result, thisNode, possibleTag);
+        return result;
     }
 
 
@@ -799,6 +802,52 @@ public:
         return std::unordered_set<Node<Accessor>>();
     }
 
+
+    ///
+    /// Ranges (see ranges.h)
+    ///
+
+    LabelRange labels () const {
+        return LabelRange (nodePrivate());
+    }
+
+    ChildRange<Accessor const> childrenInLabel (Label const & label) const {
+        return ChildRange<Accessor const> (nodePrivate(), label);
+    }
+
+    ChildRange<Accessor> childrenInLabel (Label const & label) {
+        return ChildRange<Accessor> (nodePrivate(), label);
+    }
+
+    PreorderRange<Accessor const> preorder () const {
+        return PreorderRange<Accessor const> (nodePrivate());
+    }
+
+    PreorderRange<Accessor> preorder () {
+        return PreorderRange<Accessor> (nodePrivate());
+    }
+
+
+    ///
+    /// Traversal cursor (see traversal.h)
+    ///
+
+    Traversal<Accessor const> traverse (
+        TraversalOrder order = TraversalOrder::Preorder,
+        std::vector<Label> labels = std::vector<Label> ()
+    ) const {
+        return Traversal<Accessor const> (
+            nodePrivate(), order, std::move(labels)
+        );
+    }
+
+    Traversal<Accessor> traverse (
+        TraversalOrder order = TraversalOrder::Preorder,
+        std::vector<Label> labels = std::vector<Label> ()
+    ) {
+        return Traversal<Accessor> (nodePrivate(), order, std::move(labels));
+    }
+
     // structural modifications
 public:
     void setTag (Tag const & tag) {
@@ -977,7 +1026,7 @@ public:
 public:
     bool isSubtreeCongruentTo (Node<Accessor const> const & other) const
     {
-        return 0 == nodePrivate().compare(
+        return nodePrivate().isSubtreeCongruentTo(
             other.accessor().nodePrivate()
         );
     }
@@ -989,7 +1038,7 @@ public:
     template <class OtherT>
     bool lowerStructureRankThan (Node<OtherT const> const & other) const
     {
-        return -1 == nodePrivate().compare(
+        return nodePrivate().lowerStructureRankThan(
             other.accessor().nodePrivate()
         );
     }
@@ -1009,7 +1058,7 @@ protected:
 
 
 // At the moment, there is a standard label for the name of a node.
-extern const Label globalLabelName;
+extern const LabelLiteral globalLabelName;
 
 // We also create a special class to represent a notion of "Emptiness"
 // that can have no tags.  I thought it was a unique enough name that isn't
@@ -1040,10 +1089,10 @@ public:
 // Some contexts may choose to place the errors into the document
 // But if an error is returned to the UI, it will render it
 
-extern const Tag globalTagError; // all errors should have this tag.
-extern const Tag globalTagCancellation; // does this need a node too?
-extern const Label globalLabelCausedBy;
-extern const Label globalLabelDescription;
+extern const TagLiteral globalTagError; // all errors should have this tag.
+extern const TagLiteral globalTagCancellation; // does this need a node too?
+extern const LabelLiteral globalLabelCausedBy;
+extern const LabelLiteral globalLabelDescription;
 
 class Error : public methyl::Accessor
 {
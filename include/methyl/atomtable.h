@@ -0,0 +1,154 @@
+//
+// atomtable.h
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#ifndef METHYL_ATOMTABLE_H
+#define METHYL_ATOMTABLE_H
+
+#include <QMutex>
+#include <QString>
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "methyl/defs.h"
+
+namespace methyl {
+
+//
+// AtomTable
+//
+// Every distinct URL used as a tag is stored once here and known by a
+// 32-bit number, which is all a Tag or Label carries for it.  Copying one
+// is copying an integer, and testing two for equality or hashing one never
+// touches the strings.  Each atom also keeps the FNV-1a hash of its URL's
+// UTF-8 text, which is what URLs are ordered by (see Tag::compare), so
+// ordering two different atoms only looks at the strings when the hashes
+// collide.
+//
+// UUIDs are not atoms (see Tag).  There is one for every node that is ever
+// given an identity, so interning them would grow the table without bound.
+//
+// Tags are often global statics, so the table can't belong to the Engine;
+// it's created on first use and lives for the rest of the program.  Atoms
+// are never removed.  They sit in fixed-size pages that never move, found
+// through directories that don't move either, so reading one back takes no
+// lock.  Looking up a URL that is already interned takes no lock either:
+// the hash index is an open-addressed array of atomic words, and when it
+// grows the old array is kept so that a reader still probing it is safe.
+//
+
+class AtomTable final {
+
+public:
+    static size_t const pageSize = 1024;
+
+    static size_t const pagesPerDirectory = 1024;
+
+    static size_t const maxDirectories = 4096;
+
+    // Never the id of an atom; Tag uses it to mark a UUID
+    static quint32 const noAtom = 0xFFFFFFFF;
+
+    struct Atom {
+        QString _url;
+        quint64 _hash;
+    };
+
+private:
+    typedef std::array<std::atomic<Atom *>, pagesPerDirectory> Directory;
+
+    // Each word is 32 bits of the URL's hash in the high half and the atom
+    // plus one in the low half, so zero is an empty slot and most mismatches
+    // are ruled out without looking at the string.
+    struct Index {
+        size_t _mask;
+        unique_ptr<std::atomic<quint64>[]> _slots;
+
+        explicit Index (size_t capacity);
+    };
+
+    QMutex _lock;
+    quint32 _count;
+
+    std::array<std::atomic<Directory *>, maxDirectories> _directories;
+
+    std::atomic<Index *> _index;
+    std::vector<unique_ptr<Index>> _indexes;
+
+private:
+    AtomTable ();
+
+    AtomTable (AtomTable const &) = delete;
+
+    AtomTable & operator= (AtomTable const &) = delete;
+
+    static quint32 foldHash (quint64 hash) {
+        return static_cast<quint32>(hash ^ (hash >> 32));
+    }
+
+    // Returns noAtom if not found
+    quint32 find (
+        Index const & index,
+        QString const & urlString,
+        quint64 hash
+    ) const;
+
+    static void place (Index & index, quint64 hash, quint32 id);
+
+    quint32 add (QString const & urlString, quint64 hash);
+
+    static Atom const & entry (quint32 id) {
+        Directory const * directory = instance()._directories[
+            id / (pageSize * pagesPerDirectory)
+        ].load(std::memory_order_acquire);
+        Atom const * page = (*directory)[
+            (id / pageSize) % pagesPerDirectory
+        ].load(std::memory_order_acquire);
+        return page[id % pageSize];
+    }
+
+public:
+    static AtomTable & instance ();
+
+    // FNV-1a over the UTF-8 encoding, the same as TagLiteral works out at
+    // compile time for an ASCII literal
+    static quint64 hashOf (QString const & urlString);
+
+    quint32 intern (QString const & urlString);
+
+    // For when the hash is already known, as it is for a TagLiteral
+    quint32 intern (QString const & urlString, quint64 hash);
+
+    // Any id that came out of intern() is good, on any thread
+    static QString const & url (quint32 id) {
+        return entry(id)._url;
+    }
+
+    static quint64 hash (quint32 id) {
+        return entry(id)._hash;
+    }
+};
+
+} // end namespace methyl
+
+#endif // METHYL_ATOMTABLE_H
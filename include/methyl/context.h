@@ -69,6 +69,7 @@ private:
     //
 friend class Engine;
 template<class> friend class Tree;
+template<class> friend class NodeView;
 private:
     static shared_ptr<Context> create();
 
@@ -25,7 +25,12 @@
 #include "defs.h"
 #include "accessor.h"
 #include "observer.h"
+#include "journal.h"
+#include "identitymap.h"
+#include "internpool.h"
 
+#include <array>
+#include <atomic>
 #include <map>
 
 namespace methyl {
@@ -35,6 +40,16 @@ typedef std::function<shared_ptr<Context>()> ContextGetter;
 typedef std::function<shared_ptr<Observer>()> ObserverGetter;
 
 
+// How new nodes get their Identity.  Random is the traditional behavior
+// of a fresh random UUID per node.  Sequential skips the system random
+// number generator entirely and hands out dense keys from per-thread
+// blocks of a counter, under an epoch chosen once per engine.
+enum class IdentityMode {
+    Random,
+    Sequential
+};
+
+
 // The methyl::Engine is responsible for managing the opening and
 // closing of databases.  It holds the global state relevant to
 // a methyl session.  There should be only one in effect at a
@@ -45,19 +60,80 @@ private:
     // Currently there is only one document in existence
     // Over the long term there will have to probably be support for more
     // Including scratch documents if they are memory mapped files
+private:
+    // Declared first so that it is destroyed last; every node and container
+    // that came out of it must be gone before the slabs are released.
+    friend class ::methyl::NodePool;
+    NodePool _nodePool;
+
 private:
     friend class ::methyl::NodePrivate;
-    QReadWriteLock _mapLock;
-    std::unordered_map<methyl::Identity, methyl::NodePrivate *> _mapIdToNode;
+    IdentityMap _mapIdToNode;
+    IdentityMode _identityMode;
+    bool _lazyIdentityIndex;
+    quint64 _identityEpoch;
+    std::atomic<quint64> _nextIdentityBlock;
     ContextGetter _contextGetter;
     ObserverGetter _observerGetter;
     shared_ptr<Observer> _dummyObserver;
+    unique_ptr<Journal> _journal;
+
+    // Deferred clones that have yet to copy their contents, by source
+    QMutex _deferredLock;
+    std::unordered_multimap<NodePrivate const *, NodePrivate *> _deferredClones;
+    std::atomic<size_t> _deferredCount;
+
+    // Where the values a root uses to vouch for cached root pointers come
+    // from (see NodePrivate::root).  Threads take them in blocks.
+    std::atomic<quint32> _nextRootEpochBlock;
+
+    InternPool _internPool;
 
 private:
     friend class ::methyl::Observer;
     std::unordered_set<Observer *> _observers;
     QReadWriteLock _observersLock;
 
+    // Reverse index: for each node slot, which observers saw what about it.
+    // It is split into stripes by slot, each with its own lock, so that
+    // observers merging reads and writers invalidating them on different
+    // nodes don't all line up behind one mutex.
+    static size_t const interestStripeCount = 64;
+
+    struct InterestStripe {
+        QMutex _lock;
+        std::vector<std::vector<Observer::Interest>> _interests;
+    };
+
+    std::array<InterestStripe, interestStripeCount> _interestStripes;
+
+    InterestStripe & interestStripe (quint32 slot) {
+        return _interestStripes[slot % interestStripeCount];
+    }
+
+    // Caller must hold the stripe's lock.  Null if nothing was ever there.
+    std::vector<Observer::Interest> * maybeInterests (quint32 slot) {
+        auto & interests = interestStripe(slot)._interests;
+        size_t const index = slot / interestStripeCount;
+        return index < interests.size() ? &interests[index] : nullptr;
+    }
+
+    std::vector<Observer::Interest> & interests (quint32 slot) {
+        auto & interests = interestStripe(slot)._interests;
+        size_t const index = slot / interestStripeCount;
+        if (index >= interests.size())
+            interests.resize(index + 1);
+        return interests[index];
+    }
+
+    // How many identities observers have looked up through tags, summed
+    // over all of them.  When zero, nodes coming and going needn't check.
+    std::atomic<size_t> _identityLookupCount;
+
+    // Observers with reads sitting in their thread buffers
+    QMutex _dirtyLock;
+    std::vector<Observer *> _dirtyObservers;
+
 public:
     // You cannot destroy observers during the enumeration...
     void forAllObservers (std::function<void(methyl::Observer &)> fn) {
@@ -69,6 +145,64 @@ public:
 
     Observer & observerInEffect ();
 
+    // Put an observer (or context) in effect for the current thread until
+    // the scope object is destroyed.  Scopes nest, and while one is active
+    // the getters passed to the Engine constructor are not consulted at
+    // all...so the hot path of every read is a thread-local pointer load,
+    // with no std::function call and no shared_ptr copy.
+    //
+    // The scope does not hold a reference; the caller must keep the
+    // observer (or context) alive for as long as the scope lasts.  Scopes
+    // don't follow work onto other threads.
+    class ObserverScope final {
+    private:
+        Observer * _previous;
+
+    public:
+        explicit ObserverScope (Observer & observer);
+        ObserverScope (ObserverScope const &) = delete;
+        ObserverScope & operator= (ObserverScope const &) = delete;
+        ~ObserverScope ();
+    };
+
+    class ContextScope final {
+    private:
+        shared_ptr<Context> const * _previous;
+
+    public:
+        explicit ContextScope (shared_ptr<Context> const & context);
+        ContextScope (ContextScope const &) = delete;
+        ContextScope & operator= (ContextScope const &) = delete;
+        ~ContextScope ();
+    };
+
+    // Run a group of writes as one unit as far as observers are concerned.
+    // Rather than each write checking for invalidated observers as it
+    // happens, what the writes changed is collected and checked once at the
+    // end, so each observer is blinded (and emits blinded()) at most once.
+    // Batches on the same thread nest; only the outermost one commits.
+    // Writes on other threads are not affected.
+    //
+    // The batch is also a group commit for the journal, if one is open:
+    // its records are written out together when the outermost batch ends.
+    //
+    // If fn throws, the writes it did make are still checked, but nothing
+    // that goes wrong while doing so is allowed to replace the exception.
+    void batch (std::function<void()> const & fn) {
+        Observer::beginBatch();
+        Journal::beginGroup();
+        try {
+            fn();
+        }
+        catch (...) {
+            Journal::endGroup(_journal.get());
+            Observer::endBatchUnwinding();
+            throw;
+        }
+        Journal::endGroup(_journal.get());
+        Observer::endBatch();
+    }
+
     shared_ptr<Context> contextForCreate ();
 
     shared_ptr<Context> contextForLookup ();
@@ -142,12 +276,79 @@ public:
         );
     }
 
+    // Only affects nodes created after the call
+    void setIdentityMode (IdentityMode mode) {
+        _identityMode = mode;
+    }
+
+    IdentityMode identityMode () const {
+        return _identityMode;
+    }
+
+    // When lazy, a node is only put into the identity index the first time
+    // its identity is requested, instead of when it is created.  Nodes that
+    // are built and thrown away without anyone asking never touch the index.
+    void setLazyIdentityIndex (bool lazy) {
+        _lazyIdentityIndex = lazy;
+    }
+
+    bool lazyIdentityIndex () const {
+        return _lazyIdentityIndex;
+    }
+
+private:
+    Identity newIdentity ();
+
+    quint32 newRootEpoch ();
+
+    // Fill in every pending clone, so the journal never sees one empty
+    void materializeDeferredClones ();
+
+    // Every node that is not inside of another, found by walking the slots
+    std::vector<NodePrivate const *> liveRoots ();
+
+public:
+    // Opt-in sharing of read-only subtrees.  The tree is given up, and in
+    // return comes a const handle on the one pooled copy congruent to it.
+    // Copying that into a document with makeDeferredCloneOfSubtree is cheap
+    // to do, but the copy is made in full once it is read.
+    template <class T>
+    Node<T const> intern (Tree<T> && tree) {
+        shared_ptr<Context> context = tree.accessor().context();
+        NodePrivate const & pooled = _internPool.intern(
+            tree.extractNodePrivate()
+        );
+        return Node<T const> (pooled, context);
+    }
+
+    size_t internedCount () const {
+        return _internPool.size();
+    }
+
+public:
     Tree<Accessor> makeNodeWithId (
         methyl::Identity const & id,
         methyl::Tag const & tag,
         optional<QString const &> name
     );
 
+    // Opening a journal replays whatever it already contains and hands
+    // back the trees that were not inside of any other tree when the log
+    // ended.  Trees made before the journal was opened are added to it (or,
+    // if the log is mostly history, it is compacted).  From then on every
+    // NodePrivate mutation is appended to it.  Only one journal may be open
+    // at a time.
+    std::vector<Tree<Accessor>> openJournal (QString const & fileName);
+
+    // The durability point: everything recorded so far is on the disk
+    void syncJournal ();
+
+    // Rewrite the log as a snapshot of what is alive now, dropping the
+    // history of how it got that way.  Must not overlap with any writes.
+    void compactJournal ();
+
+    void closeJournal ();
+
 public:
     explicit Engine ();
 
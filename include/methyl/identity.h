@@ -50,6 +50,30 @@ public:
     {
     }
 
+    // Identities handed out from the engine's sequential mode are a 64-bit
+    // epoch for the session plus a 64-bit counter.  They are still stored
+    // as a UUID (in the version 8 "custom" layout) so they can be exported
+    // and mixed freely with randomly generated ones.  A few bits of each
+    // half are given up to the version and variant markers.
+    static Identity fromSequence (quint64 epoch, quint64 sequence) {
+        uchar const b[8] = {
+            static_cast<uchar>(0x80 | ((sequence >> 56) & 0x3F)),
+            static_cast<uchar>(sequence >> 48),
+            static_cast<uchar>(sequence >> 40),
+            static_cast<uchar>(sequence >> 32),
+            static_cast<uchar>(sequence >> 24),
+            static_cast<uchar>(sequence >> 16),
+            static_cast<uchar>(sequence >> 8),
+            static_cast<uchar>(sequence)
+        };
+        return Identity (QUuid (
+            static_cast<uint>(epoch >> 32),
+            static_cast<ushort>(epoch >> 16),
+            static_cast<ushort>(0x8000 | (epoch & 0x0FFF)),
+            b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]
+        ));
+    }
+
     QUuid toUuid() const {
         return _uuid;
     }
@@ -75,6 +99,11 @@ namespace std {
     // Need this to get std::unordered_set to work on Identity
     // http://stackoverflow.com/questions/8157937/
 
+    // qHash on a QUuid just xors the pieces together, which leaves the high
+    // bits poorly distributed (and the IdentityMap picks shards from those).
+    // Folding the two halves with a multiply is about as cheap and mixes
+    // sequential identities, which differ only in the low bytes, well.
+
     template <>
     struct hash<methyl::Identity>
     {
@@ -82,7 +111,18 @@ namespace std {
             methyl::Identity const & id
         ) const
         {
-            return qHash(id._uuid);
+            QUuid const & uuid = id._uuid;
+            quint64 const high = (static_cast<quint64>(uuid.data1) << 32)
+                | (static_cast<quint64>(uuid.data2) << 16)
+                | uuid.data3;
+
+            quint64 low = 0;
+            for (uchar byte : uuid.data4)
+                low = (low << 8) | byte;
+
+            quint64 const mixed = (high ^ (low * 0x9E3779B97F4A7C15ULL))
+                * 0xC2B2AE3D27D4EB4FULL;
+            return static_cast<size_t>(mixed ^ (mixed >> 29));
         }
     };
 
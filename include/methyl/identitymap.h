@@ -0,0 +1,158 @@
+//
+// identitymap.h
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#ifndef METHYL_IDENTITYMAP_H
+#define METHYL_IDENTITYMAP_H
+
+#include <QMutex>
+
+#include <array>
+#include <atomic>
+#include <vector>
+
+#include "methyl/defs.h"
+#include "methyl/identity.h"
+
+namespace methyl {
+
+class NodePrivate;
+
+//
+// IdentityMap
+//
+// Every node that gets created is registered so it can be found again by
+// its Identity.  With one lock over one hash table, building trees on
+// several threads at once just meant taking turns at that lock.
+//
+// So the map is split into shards, picked by the hash of the Identity.
+// Each shard has its own table, and sits on its own cache line so that
+// threads working in different shards are not fighting over the same
+// memory.  Writers to a shard take turns at its mutex.
+//
+// Lookups take no lock at all, and write nothing.  A shard's table is an
+// open-addressed array of atomic words, guarded by a sequence number that
+// a writer makes odd while it works.  A reader notes the sequence, probes,
+// and tries again if the sequence has changed underneath it.  So readers
+// never bounce a lock's cache line between them, and only wait on a writer
+// that is in the very shard they are reading.
+//
+// Removal shifts later entries back into the gap instead of leaving
+// markers, so churn doesn't fill a table up.  A table is only replaced
+// when it grows, and the old one is kept (a reader may still be probing
+// it) until the map is destroyed.  That is at most as much again as the
+// biggest the table has been.
+//
+
+class IdentityMap final {
+
+public:
+    static size_t const shardCount = 64;
+
+    static size_t const initialCapacity = 16;
+
+private:
+    struct Slot {
+        std::atomic<size_t> _hash;
+        std::atomic<quint64> _high;
+        std::atomic<quint64> _low;
+        std::atomic<NodePrivate *> _node; // null if the slot is empty
+    };
+
+    struct Table {
+        size_t _mask;
+        unique_ptr<Slot[]> _slots;
+
+        explicit Table (size_t capacity);
+    };
+
+    struct alignas(64) Shard {
+        QMutex _writeLock;
+        std::atomic<quint32> _sequence;
+        std::atomic<Table *> _table;
+        std::atomic<size_t> _count;
+
+        // The current table is the last; the others are kept for readers
+        std::vector<unique_ptr<Table>> _tables;
+    };
+
+    std::array<Shard, shardCount> _shards;
+
+private:
+    static size_t shardFor (size_t hash);
+
+    static NodePrivate * probe (
+        Table const & table,
+        size_t hash,
+        quint64 high,
+        quint64 low
+    );
+
+    // The rest are for writers, who must hold the shard's lock and have
+    // made its sequence odd
+
+    static Slot * maybeSlot (
+        Table const & table,
+        size_t hash,
+        quint64 high,
+        quint64 low
+    );
+
+    static void place (
+        Table & table,
+        size_t hash,
+        quint64 high,
+        quint64 low,
+        NodePrivate * nodePrivate
+    );
+
+    static void remove (Table & table, Slot & slot);
+
+    static void beginWrite (Shard & shard);
+
+    static void endWrite (Shard & shard);
+
+public:
+    IdentityMap ();
+
+    IdentityMap (IdentityMap const &) = delete;
+
+    IdentityMap & operator= (IdentityMap const &) = delete;
+
+public:
+    NodePrivate * maybeFind (Identity const & id) const;
+
+    // Returns false if the Identity was already in use
+    bool insert (Identity const & id, NodePrivate * nodePrivate);
+
+    bool erase (Identity const & id);
+
+    // Removing a whole subtree's worth of identities groups them by shard
+    // first, so each shard is locked once no matter how many nodes there
+    // are.  Returns how many were actually found and removed.
+    size_t eraseBulk (std::vector<Identity> const & ids);
+
+    // Not a snapshot; other threads may be changing it while it is counted
+    size_t size () const;
+};
+
+} // end namespace methyl
+
+#endif // METHYL_IDENTITYMAP_H
@@ -0,0 +1,87 @@
+//
+// internpool.h
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#ifndef METHYL_INTERNPOOL_H
+#define METHYL_INTERNPOOL_H
+
+#include <QMutex>
+
+#include <unordered_map>
+
+#include "methyl/defs.h"
+
+namespace methyl {
+
+class NodePrivate;
+
+//
+// InternPool
+//
+// Holds one frozen copy of each distinct subtree handed to it, keyed by
+// the subtree's structural hash (see NodePrivate::subtreeHash).  Interning
+// a tree that is congruent to one already in the pool frees the new tree
+// and hands back the pooled one, so a document full of identical pieces
+// keeps only one of each piece.
+//
+// A node has only one parent, so a pooled subtree can't be linked into a
+// document directly.  The pool only ever gives out const access to what it
+// holds.  Copying a pooled subtree into a document can be done with a
+// deferred clone (see Node::makeDeferredCloneOfSubtree).  That clone is not
+// shared: the first read fills it in as a full private copy.  So the pool
+// saves memory on the pieces it holds, and on copies that are made but
+// never read--not on copies a document actually uses.  Since pooled trees
+// are never written, those clones are at least never forced to fill
+// themselves in early.
+//
+// The identities of pooled nodes are not meaningful; which of several
+// congruent trees survives is up to whichever was interned first.
+//
+
+class InternPool final {
+
+private:
+    QMutex mutable _lock;
+    std::unordered_multimap<size_t, NodePrivate *> _trees;
+
+public:
+    InternPool ();
+
+    InternPool (InternPool const &) = delete;
+
+    InternPool & operator= (InternPool const &) = delete;
+
+    ~InternPool ();
+
+public:
+    // Takes a root (a node with no parent) and returns the pooled tree
+    // congruent to it, which may be the same tree
+    NodePrivate const & intern (unique_ptr<NodePrivate> tree);
+
+    size_t size () const;
+
+    // Frees everything in the pool.  Any Node referring to a pooled tree is
+    // left dangling, so this is for engine shutdown.
+    void clear ();
+};
+
+} // end namespace methyl
+
+#endif // METHYL_INTERNPOOL_H
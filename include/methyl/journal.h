@@ -0,0 +1,220 @@
+//
+// journal.h
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#ifndef METHYL_JOURNAL_H
+#define METHYL_JOURNAL_H
+
+#include <QDataStream>
+#include <QFile>
+#include <QMutex>
+
+#include <vector>
+
+#include "methyl/defs.h"
+#include "methyl/identity.h"
+#include "methyl/tag.h"
+#include "methyl/label.h"
+
+namespace methyl {
+
+class NodePrivate;
+
+//
+// Journal
+//
+// This is the first step back toward the transaction-logged memory-mapped
+// file that Methyl originally ran on.  Every mutation that goes through the
+// NodePrivate API is appended as a record to a write-ahead log, in the
+// order it happened.  Opening a journal maps the existing log into memory
+// and replays it, so crash recovery is a matter of re-running mutations
+// instead of reparsing a serialized document.
+//
+// Each record is framed with its length and a checksum.  If the process
+// died in the middle of an append, the torn record at the tail is detected
+// during replay and truncated away before new records are appended.
+//
+// The log only makes sense for nodes whose creation it contains, so trees
+// that were made before the journal was opened are appended to it as a
+// snapshot: a create record for every node and an insert record for every
+// parent/child link.  Compaction rewrites the whole log that way, dropping
+// the history.  It happens when asked for, or on opening a log that has
+// grown to several times the size a snapshot of what it holds would be.
+//
+// Records are not written one by one.  They collect in a buffer that is
+// written out when the outermost Engine::batch on the writing thread ends
+// (a write outside of any batch is its own batch), or when the buffer gets
+// large.  Written-out records survive the process crashing.  Surviving the
+// machine crashing takes an explicit sync().
+//
+// That is all this is: a log with snapshots.  Nodes still live on the heap
+// and are rebuilt by replay when a journal is opened.  A relocatable store
+// addressed by offsets, which could be opened without replay, has to wait
+// until NodePrivate stops holding QString and Tag by value.
+//
+
+class Journal final {
+
+public:
+    enum class Opcode : quint8 {
+        CreateWithTag = 1,
+        CreateAsText = 2,
+        SetTag = 3,
+        SetText = 4,
+        InsertChildAsFirstInLabel = 5,
+        InsertChildAsLastInLabel = 6,
+        InsertSiblingAfter = 7,
+        InsertSiblingBefore = 8,
+        Detach = 9,
+        ReplaceWith = 10,
+        Destroy = 11
+    };
+
+public:
+    explicit Journal (QString const & fileName, codeplace const & cp);
+
+    ~Journal ();
+
+    Journal (Journal const &) = delete;
+
+    Journal & operator= (Journal const &) = delete;
+
+
+    // Replay whatever is already in the log.  Any node that was not inside
+    // of another node when the log ended is handed back as an owned root.
+    // Must be called before the journal starts recording, as the replay
+    // itself goes through the NodePrivate mutation API.
+public:
+    std::vector<unique_ptr<NodePrivate>> replay (codeplace const & cp);
+
+    // Replace the whole log with a snapshot of the given trees, which
+    // should be every tree that is alive.  The snapshot is written to the
+    // side and swapped in, so a crash leaves either the old log or the new
+    // one.  No writes may be going on while this runs.
+    void compact (
+        std::vector<NodePrivate const *> const & roots,
+        codeplace const & cp
+    );
+
+    // Add a snapshot of trees the log has never seen to the end of it
+    void appendTrees (std::vector<NodePrivate const *> const & roots);
+
+    // Whether the log holds so much history that, with this many nodes
+    // alive, it's worth compacting
+    bool wantsCompaction (size_t liveNodes) const;
+
+
+    // Group commit.  Groups nest per thread, and records are held back
+    // until the outermost one on the thread that wrote them ends.  The
+    // journal passed to endGroup may be null if none is open.
+public:
+    static void beginGroup ();
+
+    static void endGroup (Journal * journal);
+
+
+    // Recording hooks, called by NodePrivate after a mutation succeeds
+public:
+    void recordCreate (NodePrivate const & node);
+
+    void recordSetTag (NodePrivate const & node, Tag const & tag);
+
+    void recordSetText (NodePrivate const & node, QString const & text);
+
+    void recordInsertChild (
+        Opcode opcode,
+        NodePrivate const & parent,
+        NodePrivate const & newChild,
+        Label const & label
+    );
+
+    void recordInsertSibling (
+        Opcode opcode,
+        NodePrivate const & sibling,
+        NodePrivate const & newSibling
+    );
+
+    void recordDetach (NodePrivate const & node);
+
+    void recordReplaceWith (
+        NodePrivate const & node,
+        NodePrivate const & replacement
+    );
+
+    void recordDestroy (NodePrivate const & node);
+
+    // Write out anything buffered and have it synced to the disk
+    void sync ();
+
+
+private:
+    static QByteArray createPayload (NodePrivate const & node);
+
+    static QByteArray insertChildPayload (
+        Opcode opcode,
+        NodePrivate const & parent,
+        NodePrivate const & newChild,
+        Label const & label
+    );
+
+    // Tags are written as the exact string they were interned from, or as
+    // UUID bytes, and not as a QUrl.  QUrl would normalize the string, and
+    // the replayed tag could then be a different atom than the original.
+    static void writeTag (QDataStream & out, Tag const & tag);
+
+    static Tag readTag (QDataStream & in);
+
+    static void writeLabel (QDataStream & out, Label const & label);
+
+    static Label readLabel (QDataStream & in);
+
+    // Adds a length and checksum in front of the payload
+    static void frameRecord (QByteArray & buffer, QByteArray const & payload);
+
+    // Returns how many nodes were in the tree
+    static size_t frameTree (QByteArray & buffer, NodePrivate const & root);
+
+    void append (QByteArray const & payload);
+
+    // Caller must hold the mutex
+    void writePending ();
+
+private:
+    // Past this much, buffered records are written out even mid-group
+    static int const pendingLimit = 1 << 20;
+
+    // Compaction is not worth it for a log with fewer records than this
+    static qint64 const compactionMinimum = 1 << 16;
+
+    // ...or with at most this many times what a snapshot would take
+    static qint64 const compactionRatio = 4;
+
+    QFile _file;
+    QMutex _mutex;
+    bool _replayed;
+    QByteArray _pending;
+
+    // Records in the log (written out or not), for deciding on compaction
+    qint64 _recordCount;
+};
+
+} // end namespace methyl
+
+#endif // METHYL_JOURNAL_H
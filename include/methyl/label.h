@@ -27,6 +27,7 @@
 namespace methyl {
 
 class NodePrivate;
+class Journal;
 
 //
 // Label
@@ -42,8 +43,16 @@ class NodePrivate;
 class Label : private Tag {
 
     friend class NodePrivate;
+    friend class LabelLiteral;
+    friend class Journal;
+    friend struct ::std::hash<Label>;
     using Tag::Tag;
 
+    explicit Label (Tag const & tag) :
+        Tag (tag)
+    {
+    }
+
 public:
     using Tag::toUrl;
 
@@ -66,6 +75,78 @@ public:
     }
 };
 
+
+
+//
+// LabelLiteral
+//
+// The Label counterpart to TagLiteral (see tag.h)
+//
+
+class LabelLiteral final {
+private:
+    TagLiteral _literal;
+
+public:
+    constexpr explicit LabelLiteral (char const * url) :
+        _literal (url)
+    {
+    }
+
+    constexpr char const * url () const {
+        return _literal.url();
+    }
+
+    constexpr quint64 hash () const {
+        return _literal.hash();
+    }
+
+    Label label () const {
+        return Label (_literal.tag());
+    }
+
+    operator Label () const {
+        return label();
+    }
+};
+
+
+// As with TagLiteral, so a literal works on either side
+
+inline bool operator== (LabelLiteral const & left, Label const & right) {
+    return left.label() == right;
+}
+
+inline bool operator== (Label const & left, LabelLiteral const & right) {
+    return left == right.label();
+}
+
+inline bool operator!= (LabelLiteral const & left, Label const & right) {
+    return left.label() != right;
+}
+
+inline bool operator!= (Label const & left, LabelLiteral const & right) {
+    return left != right.label();
+}
+
 } // end namespace methyl
 
+
+namespace std {
+
+    // Wide label tables index their labels in an unordered_map
+
+    template <>
+    struct hash<methyl::Label>
+    {
+        size_t operator()(
+            methyl::Label const & label
+        ) const
+        {
+            return hash<methyl::Tag>()(label);
+        }
+    };
+
+} // end namespace std
+
 #endif
@@ -0,0 +1,275 @@
+//
+// labeltable.h
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#ifndef METHYL_LABELTABLE_H
+#define METHYL_LABELTABLE_H
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+#include "methyl/defs.h"
+#include "methyl/label.h"
+#include "methyl/nodepool.h"
+
+namespace methyl {
+
+//
+// LabelTable
+//
+// Most tagged nodes have somewhere between zero and three labels, so giving
+// each of them a red-black tree (with a separately allocated node per label)
+// costs a lot of memory and scatters the lookups.  A LabelTable keeps the
+// (label, value) pairs in one contiguous pooled array, sorted in the order
+// of Label::operator< (which is Tag::compare), and searches it directly.
+//
+// Only once a node is wide enough for that search to get expensive does it
+// grow a hashed index from label to position.  The array stays the source
+// of truth for the ordering either way.  Adding or removing a label would
+// shift every position after it, so instead the index is just dropped.
+// Lookups on a wide table without an index binary search the array, and
+// once there have been as many of them as there are labels, one of them
+// builds a new index.  So a run of changes costs nothing extra per change,
+// and the rebuild is paid for by the lookups that come after.
+//
+// Lookups may run on several threads at once, so a rebuilt index is
+// published with a compare-and-swap, and only a writer (which must have
+// the table to itself) ever frees one.  The index, like the array, lives
+// in the Engine's pool.
+//
+// The interface is the subset of std::map that NodePrivate actually uses.
+//
+
+template <class Value>
+class LabelTable final {
+
+public:
+    typedef std::pair<Label, Value> value_type;
+
+    static size_t const wideThreshold = 16;
+
+private:
+    typedef std::vector<value_type, PoolAllocator<value_type>> entry_vector;
+
+    typedef std::unordered_map<
+        Label,
+        size_t,
+        std::hash<Label>,
+        std::equal_to<Label>,
+        PoolAllocator<std::pair<Label const, size_t>>
+    > index_map;
+
+    entry_vector _entries;
+    std::atomic<index_map *> mutable _index;
+
+    // Lookups done on a wide table since its index was last dropped
+    std::atomic<size_t> mutable _lookupsWithoutIndex;
+
+public:
+    typedef typename entry_vector::iterator iterator;
+    typedef typename entry_vector::const_iterator const_iterator;
+
+public:
+    LabelTable () :
+        _index (nullptr),
+        _lookupsWithoutIndex (0)
+    {
+    }
+
+    LabelTable (LabelTable && other) :
+        _entries (std::move(other._entries)),
+        _index (other._index.exchange(nullptr)),
+        _lookupsWithoutIndex (0)
+    {
+    }
+
+    LabelTable & operator= (LabelTable && other) {
+        if (this != &other) {
+            _entries = std::move(other._entries);
+            dropIndex();
+            _index.store(other._index.exchange(nullptr));
+        }
+        return *this;
+    }
+
+    ~LabelTable () {
+        dropIndex();
+    }
+
+
+public:
+    iterator begin () { return _entries.begin(); }
+
+    iterator end () { return _entries.end(); }
+
+    const_iterator begin () const { return _entries.begin(); }
+
+    const_iterator end () const { return _entries.end(); }
+
+    bool empty () const { return _entries.empty(); }
+
+    size_t size () const { return _entries.size(); }
+
+    void reserve (size_t count) { _entries.reserve(count); }
+
+
+private:
+    const_iterator lowerBound (Label const & label) const {
+        return std::lower_bound(
+            _entries.begin(),
+            _entries.end(),
+            label,
+            [](value_type const & entry, Label const & label) {
+                return entry.first < label;
+            }
+        );
+    }
+
+    index_map * makeIndex () const {
+        index_map * index = PoolAllocator<index_map>().allocate(1);
+        new (index) index_map;
+
+        index->reserve(_entries.size());
+        for (size_t position = 0; position < _entries.size(); position++)
+            index->insert(std::make_pair(_entries[position].first, position));
+        return index;
+    }
+
+    static void freeIndex (index_map * index) {
+        index->~index_map();
+        PoolAllocator<index_map>().deallocate(index, 1);
+    }
+
+    // Writers only
+    void dropIndex () {
+        index_map * index = _index.exchange(nullptr);
+        if (index)
+            freeIndex(index);
+        _lookupsWithoutIndex.store(0, std::memory_order_relaxed);
+    }
+
+    // Returns null if it's still cheaper to search the array
+    index_map const * maybeIndex () const {
+        index_map * index = _index.load(std::memory_order_acquire);
+        if (index or _entries.size() < wideThreshold)
+            return index;
+
+        size_t const lookups = _lookupsWithoutIndex.fetch_add(
+            1, std::memory_order_relaxed
+        );
+        if (lookups + 1 < _entries.size())
+            return nullptr;
+
+        // Another lookup may be building one at the same time; if it got
+        // there first, use that one instead
+        index_map * built = makeIndex();
+        index_map * expected = nullptr;
+        if (_index.compare_exchange_strong(
+            expected, built, std::memory_order_acq_rel
+        )) {
+            return built;
+        }
+        freeIndex(built);
+        return expected;
+    }
+
+
+public:
+    const_iterator find (Label const & label) const {
+        if (index_map const * index = maybeIndex()) {
+            auto iter = index->find(label);
+            if (iter == index->end())
+                return _entries.end();
+            return _entries.begin() + iter->second;
+        }
+
+        if (_entries.size() >= wideThreshold) {
+            auto iter = lowerBound(label);
+            if (iter != _entries.end() and iter->first == label)
+                return iter;
+            return _entries.end();
+        }
+
+        // Labels compare as atoms (or inline UUIDs), so a straight scan is
+        // cheap compares.  That beats a binary search, which would have to
+        // order the labels.
+        for (auto iter = _entries.begin(); iter != _entries.end(); ++iter) {
+            if (iter->first == label)
+                return iter;
+        }
+        return _entries.end();
+    }
+
+    iterator find (Label const & label) {
+        LabelTable const & constRef = *this;
+        return _entries.begin()
+            + (constRef.find(label) - constRef._entries.begin());
+    }
+
+    std::pair<iterator, bool> insert (value_type && entry) {
+        auto position = lowerBound(entry.first) - _entries.cbegin();
+        if (
+            position != static_cast<ptrdiff_t>(_entries.size())
+            and _entries[position].first == entry.first
+        ) {
+            return std::make_pair(_entries.begin() + position, false);
+        }
+
+        _entries.insert(_entries.begin() + position, std::move(entry));
+        dropIndex();
+        return std::make_pair(_entries.begin() + position, true);
+    }
+
+    // Fill an empty table from another one in a single pass, producing each
+    // new value from the corresponding old one.  The source is already in
+    // order, so there's no searching and the index is built just once.
+    template <class OtherValue, class Fn>
+    void assignFrom (LabelTable<OtherValue> const & other, Fn && fn) {
+        hopefully(_entries.empty(), HERE);
+
+        _entries.reserve(other.size());
+        for (auto const & entry : other)
+            _entries.emplace_back(entry.first, fn(entry.second));
+        if (_entries.size() >= wideThreshold)
+            _index.store(makeIndex(), std::memory_order_release);
+    }
+
+    iterator erase (iterator iter) {
+        auto position = iter - _entries.begin();
+        _entries.erase(iter);
+        dropIndex();
+        return _entries.begin() + position;
+    }
+
+    size_t erase (Label const & label) {
+        auto iter = find(label);
+        if (iter == end())
+            return 0;
+        erase(iter);
+        return 1;
+    }
+};
+
+} // end namespace methyl
+
+#endif // METHYL_LABELTABLE_H
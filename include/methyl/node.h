@@ -74,6 +74,7 @@ friend class Accessor;
 friend class Engine;
 template <class> friend class Tree;
 template <class> friend class Node;
+template <class> friend class NodeView;
 
 private:
     Node () = delete;
@@ -244,7 +245,19 @@ public:
 public:
     Tree<T> makeCloneOfSubtree() const {
         return Tree<T> (
-            std::move(accessor().nodePrivate().makeCloneOfSubtree()),
+            accessor().nodePrivate().makeCloneOfSubtree(),
+            accessor().context()
+        );
+    }
+
+    // Opt-in: only the root is made now, and the rest is copied in full the
+    // first time the clone is read, or just before this subtree (or anything
+    // above it) is changed or freed.  Nothing is shared, so this only pays
+    // off for copies that are often thrown away unread.  While any deferred
+    // clone is pending, every write walks up to the root to check for them.
+    Tree<T> makeDeferredCloneOfSubtree() const {
+        return Tree<T> (
+            accessor().nodePrivateAsIs().makeDeferredCloneOfSubtree(),
             accessor().context()
         );
     }
@@ -282,6 +295,7 @@ friend class Accessor;
 friend class Engine;
 template <class> friend class Tree;
 template <class> friend class Node;
+template <class> friend class NodeView;
 
 template <class> friend struct ::std::hash;
 
@@ -0,0 +1,206 @@
+//
+// nodepool.h
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#ifndef METHYL_NODEPOOL_H
+#define METHYL_NODEPOOL_H
+
+#include <QMutex>
+
+#include <array>
+#include <atomic>
+#include <vector>
+
+#include "methyl/defs.h"
+
+namespace methyl {
+
+//
+// NodePool
+//
+// A tree with millions of nodes would otherwise do millions of small heap
+// allocations, each NodePrivate plus the label table and child vectors it
+// owns.  The Engine owns one of these slab allocators, and NodePrivate and
+// its containers get their memory from it.
+//
+// Requests are rounded up to a size class.  Each class carves blocks off of
+// large slabs and keeps a free list of returned blocks.  Anything larger
+// than the biggest class goes to the ordinary heap.  Slabs are only given
+// back when the pool itself goes away.
+//
+// Threads don't go to the shared free list for every block.  Each one keeps
+// a small stack of blocks per class, and only takes the class lock to grab
+// or give back half a stack at a time, so parallel node creation does not
+// serialize on the pool.
+//
+
+class NodePool final {
+
+public:
+    static size_t const slabSize = 64 * 1024;
+
+private:
+    // Halfway steps between the powers of two keep the waste on something
+    // the size of a NodePrivate reasonable.
+    static constexpr std::array<size_t, 12> classSizes () {
+        return {{16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024}};
+    }
+
+    struct FreeBlock {
+        FreeBlock * _next;
+    };
+
+    struct SizeClass {
+        QMutex _mutex;
+        FreeBlock * _free;
+        char * _bump;
+        char * _bumpEnd;
+
+        SizeClass () :
+            _free (nullptr),
+            _bump (nullptr),
+            _bumpEnd (nullptr)
+        {
+        }
+    };
+
+    std::array<SizeClass, 12> _classes;
+
+    // Per-thread block stacks; defined in nodepool.cpp
+    struct ThreadCache;
+
+    // Distinguishes this pool from an earlier one at the same address, so
+    // a thread's cache never hands out blocks from a pool that is gone.
+    quint64 const _serial;
+
+    QMutex _slabsMutex;
+    std::vector<char *> _slabs;
+
+    // Threads take slots a block at a time too.  The owner table is paged
+    // so it never moves, which lets maybeSlotOwner read it without a lock.
+    static size_t const slotBlockSize = 64;
+    static size_t const slotPageSize = 4096;
+    static size_t const maxSlotPages = 16384;
+
+    QMutex _slotsMutex;
+    quint32 _nextSlot;
+    std::vector<quint32> _freeSlots;
+    unique_ptr<std::atomic<std::atomic<void *> *>[]> _slotPages;
+
+    // Caches that may be holding slots of this pool, guarded by _slotsMutex
+    std::vector<ThreadCache *> _caches;
+
+private:
+    static int classForSize (size_t size);
+
+    char * newSlab ();
+
+    ThreadCache & cacheForThisThread ();
+
+    // Under the class lock: top up a thread's stack, or take half of it back
+    void refill (int index, ThreadCache & cache);
+
+    void drain (int index, ThreadCache & cache, size_t count);
+
+    // Under the slots lock: the same for a thread's stack of free slots
+    void refillSlots (ThreadCache & cache);
+
+    void drainSlots (ThreadCache & cache, size_t count);
+
+public:
+    NodePool ();
+
+    NodePool (NodePool const &) = delete;
+
+    NodePool & operator= (NodePool const &) = delete;
+
+    ~NodePool ();
+
+    // The pool belonging to the Engine in effect
+    static NodePool & current ();
+
+public:
+    void * allocate (size_t size);
+
+    void deallocate (void * pointer, size_t size);
+
+    // Return many same-sized blocks at once, under one lock.  This is how
+    // a whole detached subtree is handed back when a Tree is freed.
+    void deallocateBulk (std::vector<void *> const & pointers, size_t size);
+
+    // Number of nodes currently alive.  Blocks can't answer this, since
+    // label tables and other containers may fall in the same size class.
+    size_t liveNodeCount ();
+
+    // Every live node also gets a small integer "slot", reused as nodes
+    // come and go, so that per-node side tables (like what an Observer
+    // has seen) can be dense arrays instead of hash maps keyed by pointer.
+    quint32 acquireSlot (void * owner);
+
+    void releaseSlots (std::vector<quint32> const & slots);
+
+    // What currently holds a slot, or null if nothing does
+    void * maybeSlotOwner (quint32 slot);
+
+    // Every slot that has ever been handed out is below this, so walking
+    // up to it with maybeSlotOwner visits every live node.
+    quint32 slotLimit ();
+};
+
+
+//
+// PoolAllocator
+//
+// Standard library allocator that routes through the Engine's pool, so the
+// containers inside of a NodePrivate come out of the same slabs.
+//
+
+template <class T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+
+    PoolAllocator () noexcept {}
+
+    template <class U>
+    PoolAllocator (PoolAllocator<U> const &) noexcept {}
+
+    T * allocate (size_t n) {
+        return static_cast<T *>(NodePool::current().allocate(n * sizeof(T)));
+    }
+
+    void deallocate (T * pointer, size_t n) noexcept {
+        NodePool::current().deallocate(pointer, n * sizeof(T));
+    }
+
+    template <class U>
+    bool operator== (PoolAllocator<U> const &) const noexcept {
+        return true;
+    }
+
+    template <class U>
+    bool operator!= (PoolAllocator<U> const &) const noexcept {
+        return false;
+    }
+};
+
+} // end namespace methyl
+
+#endif // METHYL_NODEPOOL_H
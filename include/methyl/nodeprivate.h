@@ -26,9 +26,35 @@
 #include "methyl/identity.h"
 #include "methyl/tag.h"
 #include "methyl/label.h"
+#include "methyl/nodepool.h"
+#include "methyl/labeltable.h"
 
+#include <atomic>
 #include <unordered_set>
 
+namespace methyl {
+
+class Journal;
+class NodePrivate;
+
+}
+
+
+namespace std {
+
+    // Freeing a NodePrivate frees everything under it.  Rather than have
+    // the destructor recurse (and have each node go back to the pool one
+    // at a time) unique_ptr hands the whole subtree to NodePrivate so it
+    // can be torn down iteratively and returned to the pool in bulk.
+
+    template <>
+    struct default_delete<methyl::NodePrivate> {
+        void operator() (methyl::NodePrivate * nodePrivate) const;
+    };
+
+} // end namespace std
+
+
 namespace methyl {
 
 // The NodePrivate name follows the Qt convention of having the private
@@ -74,6 +100,13 @@ public:
 
     unique_ptr<NodePrivate> makeCloneOfSubtree () const;
 
+    // Makes only the root of the clone right away.  The rest is copied from
+    // the original the first time the clone is accessed, or just before the
+    // original (or anything above it) is changed or freed.  So a clone that
+    // is made and never looked at costs next to nothing, but nothing is
+    // shared: once filled in, it takes as much memory as any other copy.
+    unique_ptr<NodePrivate> makeDeferredCloneOfSubtree () const;
+
     Identity identity() const;
 
 
@@ -301,7 +334,7 @@ public:
 
     struct detach_info final {
         NodePrivate const & _nodeParent;
-        Label const & _labelInParent;
+        Label _labelInParent;
         NodePrivate const * _previousChild;
         NodePrivate const * _nextChild;
 
@@ -330,27 +363,22 @@ public:
 
 // traversal and comparison
 public:
+    // The stackless step that compare(), the journal's replay and snapshot,
+    // and PreorderRange are built on.  (The subtree hash has a postorder
+    // walk of its own, in computeSubtreeSummary.)
     NodePrivate const * maybeNextPreorderNodeUnderRoot(
         NodePrivate const & nodeRoot
     ) const {
-        NodePrivate const * nodeCur = this;
-        if (nodeCur->hasAnyLabels())
-            return &nodeCur->firstChildInLabel(
-                nodeCur->firstLabel(HERE), HERE
-            );
+        if (NodePrivate const * firstChild = maybeFirstChild())
+            return firstChild;
 
+        // The sibling links cross label boundaries, so there's no need to
+        // consult the parent's label table on the way back up.
+        NodePrivate const * nodeCur = this;
         while (nodeCur != &nodeRoot) {
-            if (nodeCur->hasNextSiblingInLabel())
-                return &nodeCur->nextSiblingInLabel(HERE);
-
-            Label labelInParent = nodeCur->labelInParent(HERE);
-            NodePrivate const & nodeParent = nodeCur->parent(HERE);
-            if (nodeParent.hasLabelAfter(labelInParent, HERE))
-                return &nodeParent.firstChildInLabel(
-                    nodeParent.labelAfter(labelInParent, HERE), HERE
-                );
-
-            nodeCur = &nodeParent;
+            if (nodeCur->_nextSibling)
+                return nodeCur->_nextSibling;
+            nodeCur = nodeCur->_parent;
         }
         return nullptr;
     }
@@ -364,14 +392,34 @@ public:
         );
     }
 
-    // I don't really like the integer return values, and I'm not sure if I'm
-    // picking the right cases to be -1 or 1.  Private for now.
+    // Returns -1, 0, or 1.  Nodes are compared in preorder: text before
+    // tags, then by the text or tag, then by the label the node is in, then
+    // by shape (a node with no children before one with children, and a
+    // last child before one with siblings after it).  Private for now.
 private:
     int compare (NodePrivate const & other) const;
 
 
 public:
+    // Order-sensitive hash of the whole subtree: tags, texts, labels, and
+    // the order of the children.  Each node caches its own, and a change
+    // clears the cache on the way up to the root, so asking again after a
+    // small edit only rehashes the path from the edit to this node.
+    size_t subtreeHash () const;
+
+    // Number of nodes in the subtree, cached along with the hash
+    size_t subtreeSize () const;
+
+    // Trees of different sizes or hashes can't be congruent, and those are
+    // already known for most nodes; only a match has to be walked to rule
+    // out a hash collision.
     bool isSubtreeCongruentTo (NodePrivate const & other) const {
+        if (this == &other)
+            return true;
+        if (subtreeSize() != other.subtreeSize())
+            return false;
+        if (subtreeHash() != other.subtreeHash())
+            return false;
         return compare(other) == 0;
     }
 
@@ -379,6 +427,8 @@ public:
     // invariants for -1 vs +1.  This is going to be canon...encoded in file
     // formats and stuff, it should be gotten right!
     bool lowerStructureRankThan (NodePrivate const & other) const {
+        if (this == &other)
+            return false;
         return compare(other) == -1;
     }
 
@@ -398,6 +448,14 @@ public:
     //
 friend class Accessor;
 friend class Engine;
+friend class Journal;
+friend class Observer;
+friend class InternPool;
+friend class LabelRange;
+template <class> friend class ChildRange;
+template <class> friend class NodeView;
+template <class> friend class PreorderRange;
+template <class> friend class Traversal;
 private:
     NodePrivate () = delete;
 
@@ -412,6 +470,13 @@ private:
     NodePrivate (Identity const & id, Tag const & tag);
 
 
+    // Memory for nodes comes from the Engine's slab pool instead of the
+    // general heap.
+    static void * operator new (size_t size);
+
+    static void operator delete (void * pointer);
+
+
     //
     // Destruction
     //
@@ -419,50 +484,123 @@ private:
     // NodePrivate is allowed.  We also make this a final class, so the
     // destructor need not be virtual.
     //
+    // The destructor only cleans up the node's own members.  Deleting
+    // through unique_ptr goes to destroySubtree, which destructs the
+    // descendants without recursion and frees all their memory at once.
+    //
 template <typename> friend struct std::default_delete;
 private:
     ~NodePrivate();
 
+    static void destroySubtree (NodePrivate * nodePrivate);
+
 
     // Miscellaneous
 private:
-    struct relationship_info {
-        std::reference_wrapper<Label const> _labelInParent;
-        std::reference_wrapper<std::vector<NodePrivate *>> _siblings;
-        std::vector<NodePrivate *>::iterator _iter;
-
-    public:
-        relationship_info (
-            Label const & label,
-            std::vector<NodePrivate *> & siblings,
-            std::vector<NodePrivate *>::iterator iter
-        ) :
-            _labelInParent (label),
-            _siblings (siblings),
-            _iter (iter)
-        {
-        }
+    static Journal * maybeJournal ();
+
+    // Add this node to the engine's identity index if it isn't there yet
+    void publishIdentity (codeplace const & cp) const;
+
+    // Make every cached pointer to this node as a root go stale
+    void renewRootEpoch () const;
+
+    // Support for deferred clones.  Only the root of a clone can be
+    // waiting on a source; inserting it anywhere fills it in first.
+    void cloneChildrenFrom (NodePrivate const & original);
+
+    void materialize () const;
+
+    void forgetDeferredClone (NodePrivate const & source) const;
+
+    static void materializeClonesOf (NodePrivate const & source);
+
+    void materializeDependents () const;
+
+    // Called by anything that changes the node's content or its children
+    void invalidateSubtreeHash ();
+
+    size_t hashOfContentAndChildren () const;
+
+    // Fills in the hash and size of any node in the subtree lacking them
+    void computeSubtreeSummary () const;
+
+    // The children in a label are not stored in a container of their own;
+    // they are found by walking the sibling links.  The table only needs to
+    // remember where each label's run of children starts and ends.
+    struct child_range {
+        NodePrivate * _first;
+        NodePrivate * _last;
     };
 
-    relationship_info relationshipToParent (
-        codeplace const & cp
-    ) const;
+    typedef LabelTable<child_range> label_table;
 
-    relationship_info relationshipToParent (
-        codeplace const & cp
+    NodePrivate * maybeFirstChild () const;
+
+    void linkIntoParent (
+        NodePrivate & parent,
+        Label const & label,
+        NodePrivate * previousSibling,
+        NodePrivate * nextSibling
     );
 
+    void unlinkFromParent ();
+
 private:
     // optional parent... null if root
     NodePrivate * _parent;
 
+    // Doubly linked list through all of the parent's children.  It runs
+    // across the labels in the same order as the label table, so the last
+    // child in one label points at the first child in the next.  That makes
+    // sibling navigation, insertion, and removal constant time.
+    NodePrivate * _previousSibling;
+    NodePrivate * _nextSibling;
+
+    // Cached so the label doesn't have to be searched for in the parent
+    optional<Label> _labelInParent;
+
     // identity of this node
     Identity _id;
 
-    // if a node has a tag, it may also have an ordered map of labels and a
-    // vector of child nodes in that label
+    // dense index of this node among the live ones, see NodePool
+    quint32 _slot;
+
+    // Whether _id has been entered into the engine's identity index.  In
+    // the lazy mode that is deferred until the identity is first handed
+    // out, so most scratch nodes are never indexed at all.
+    std::atomic<bool> mutable _published;
+
+    // If this is a deferred clone that hasn't been filled in yet, the node
+    // whose children it will copy.  Null otherwise.
+    std::atomic<NodePrivate const *> mutable _deferredSource;
+
+    // Set while some deferred clone is waiting to copy from this node, so
+    // a mutation only has to go to the engine's table for actual sources
+    std::atomic<bool> mutable _hasDeferredClones;
+
+    // Last answer from root(), so that finding the root is usually not a
+    // walk upward.  It's the root's slot plus one in the low half, and the
+    // root's epoch at the time in the high half; zero means nothing cached.
+    std::atomic<quint64> mutable _cachedRoot;
+
+    // A fresh value is taken whenever this node is made a root, stops being
+    // one, or has a subtree taken out from under it.  Nodes below cache it
+    // with the root's slot, so one tree's changes leave other trees' cached
+    // roots alone.
+    std::atomic<quint32> mutable _rootEpoch;
+
+    // Zero if not computed.  A node with a cached hash always has cached
+    // hashes all the way down, so clearing can stop at the first node that
+    // is already clear.  The size is stored first and cleared with the hash,
+    // so a nonzero hash means the size is good too.
+    std::atomic<size_t> mutable _subtreeHash;
+    std::atomic<size_t> mutable _subtreeSize;
+
+    // if a node has a tag, it may also have an ordered table of labels and
+    // the range of child nodes in that label
     optional<Tag> _tag;
-    std::map<Label, std::vector<NodePrivate *>> _labelToChildren;
+    label_table _labelToChildren;
 
     // Nodes which do not have tags must have a unicode string of data,
     // and no child nodes.
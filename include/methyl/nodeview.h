@@ -0,0 +1,240 @@
+//
+// nodeview.h
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#ifndef METHYL_NODEVIEW_H
+#define METHYL_NODEVIEW_H
+
+#include "methyl/nodeprivate.h"
+#include "methyl/context.h"
+#include "methyl/node.h"
+
+namespace methyl {
+
+//
+// NodeView is a borrowed handle to a node: just the NodePrivate pointer,
+// with no Context.  Copying a Node costs an atomic increment and decrement
+// on its shared_ptr<Context>, which adds up in a loop that visits millions
+// of nodes.  A view costs nothing to copy, and navigating from it produces
+// more views.
+//
+// The price is that a view can't check its Context for validity, so it may
+// only be used while something else holds a Node or Tree in the same tree
+// (which keeps the Context alive and the node valid).  Use toNode() to get
+// a real handle back when one has to be kept.
+//
+// Reads through a view are reported to the observer in effect just as
+// with a Node.  The view's own navigation works on the NodePrivate directly
+// and yields views.  operator-> offers the rest of the accessor interface;
+// what it returns are ordinary Nodes, carrying the Context a lookup gives,
+// so that one has to be fetched for each use of the arrow.
+//
+
+template <class T>
+class NodeView final {
+    static_assert(
+        std::is_base_of<Accessor, typename std::remove_const<T>::type>::value,
+        "NodeView<> may only be parameterized with a class derived from Node"
+    );
+
+template <class> friend class NodeView;
+template <class> friend class ChildRange;
+template <class> friend class PreorderRange;
+template <class> friend class Traversal;
+
+public:
+    // What navigation yields, as with the untyped Node results of Accessor
+    typedef typename std::conditional<
+        std::is_const<T>::value, Accessor const, Accessor
+    >::type base_type;
+
+private:
+    NodePrivate * _nodePrivate;
+
+    // The accessor is manufactured on demand, so the view itself can stay
+    // a single pointer
+    class Arrow final {
+    private:
+        typename std::remove_const<T>::type _accessor;
+
+    public:
+        explicit Arrow (NodePrivate * nodePrivate) {
+            _accessor.setInternalProperties(nodePrivate, Context::lookup());
+        }
+
+        T * operator-> () {
+            return &_accessor;
+        }
+    };
+
+    explicit NodeView (NodePrivate const * nodePrivate) :
+        _nodePrivate (const_cast<NodePrivate *>(nodePrivate))
+    {
+    }
+
+    static optional<NodeView<base_type>> viewOf (NodePrivate const * node) {
+        if (not node)
+            return nullopt;
+        return NodeView<base_type> (node);
+    }
+
+    // A deferred clone gets filled in before anyone looks, as with Accessor
+    NodePrivate const & nodePrivate () const {
+        _nodePrivate->materialize();
+        return *_nodePrivate;
+    }
+
+public:
+    // Borrow from a Node, with the same rules for implicit conversion
+    template <class U>
+    NodeView (
+        Node<U> const & node,
+        typename std::enable_if<
+            std::is_base_of<typename std::remove_const<T>::type,
+                typename std::remove_const<U>::type>::value
+            and (std::is_const<T>::value or not std::is_const<U>::value),
+            void *
+        >::type = nullptr
+    ) :
+        NodeView (&node.accessor().nodePrivateAsIs())
+    {
+    }
+
+    template <class U>
+    NodeView (
+        NodeView<U> const & other,
+        typename std::enable_if<
+            std::is_base_of<typename std::remove_const<T>::type,
+                typename std::remove_const<U>::type>::value
+            and (std::is_const<T>::value or not std::is_const<U>::value),
+            void *
+        >::type = nullptr
+    ) :
+        _nodePrivate (other._nodePrivate)
+    {
+    }
+
+    Arrow operator-> () const {
+        return Arrow (_nodePrivate);
+    }
+
+    template <class U>
+    bool operator== (NodeView<U> const & other) const {
+        return _nodePrivate == other._nodePrivate;
+    }
+
+    template <class U>
+    bool operator!= (NodeView<U> const & other) const {
+        return _nodePrivate != other._nodePrivate;
+    }
+
+    // Get a full handle back, e.g. to store the node past the loop.  The
+    // Context is whatever a lookup would give, unless one is supplied.
+    Node<T> toNode () const {
+        return toNode(Context::lookup());
+    }
+
+    Node<T> toNode (shared_ptr<Context> const & context) const {
+        return Node<T> (*_nodePrivate, context);
+    }
+
+
+public:
+    // Navigation.  These make exactly the reads, and report exactly the
+    // observations, of the Accessor equivalents, without making Nodes.
+
+    optional<NodeView<base_type>> maybeParent () const {
+        NodePrivate const & node = nodePrivate();
+        Observer & observer = Observer::current();
+
+        bool const hasParent = node.hasParent();
+        observer.hasParent(hasParent, node);
+        if (not hasParent)
+            return nullopt;
+
+        NodePrivate const & result = node.parent(HERE);
+        observer.parent(result, node);
+        return viewOf(&result);
+    }
+
+    optional<NodeView<base_type>> maybeFirstChildInLabel (
+        Label const & label
+    ) const {
+        NodePrivate const & node = nodePrivate();
+        Observer & observer = Observer::current();
+
+        bool const hasLabel = node.hasLabel(label);
+        observer.hasLabel(hasLabel, node, label);
+        if (not hasLabel)
+            return nullopt;
+
+        NodePrivate const & result = node.firstChildInLabel(label, HERE);
+        observer.firstChildInLabel(result, node, label);
+        return viewOf(&result);
+    }
+
+    optional<NodeView<base_type>> maybeLastChildInLabel (
+        Label const & label
+    ) const {
+        NodePrivate const & node = nodePrivate();
+        Observer & observer = Observer::current();
+
+        bool const hasLabel = node.hasLabel(label);
+        observer.hasLabel(hasLabel, node, label);
+        if (not hasLabel)
+            return nullopt;
+
+        NodePrivate const & result = node.lastChildInLabel(label, HERE);
+        observer.lastChildInLabel(result, node, label);
+        return viewOf(&result);
+    }
+
+    optional<NodeView<base_type>> maybeNextSiblingInLabel () const {
+        NodePrivate const & node = nodePrivate();
+        Observer & observer = Observer::current();
+
+        bool const hasNext = node.hasNextSiblingInLabel();
+        observer.hasNextSiblingInLabel(hasNext, node);
+        if (not hasNext)
+            return nullopt;
+
+        NodePrivate const & result = node.nextSiblingInLabel(HERE);
+        observer.nextSiblingInLabel(result, node);
+        return viewOf(&result);
+    }
+
+    optional<NodeView<base_type>> maybePreviousSiblingInLabel () const {
+        NodePrivate const & node = nodePrivate();
+        Observer & observer = Observer::current();
+
+        bool const hasPrevious = node.hasPreviousSiblingInLabel();
+        observer.hasPreviousSiblingInLabel(hasPrevious, node);
+        if (not hasPrevious)
+            return nullopt;
+
+        NodePrivate const & result = node.previousSiblingInLabel(HERE);
+        observer.previousSiblingInLabel(result, node);
+        return viewOf(&result);
+    }
+};
+
+} // end namespace methyl
+
+#endif // METHYL_NODEVIEW_H
@@ -22,9 +22,13 @@
 #ifndef METHYL_OBSERVER_H
 #define METHYL_OBSERVER_H
 
+#include <array>
+#include <atomic>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <type_traits>
+#include <vector>
 
 #include "hoist/hoist.h"
 #include "methyl/defs.h"
@@ -92,13 +96,122 @@ public:
         NextSiblingInLabel = 1 << 9,
         HasPreviousSiblingInLabel = 1 << 10,
         PreviousSiblingInLabel = 1 << 11,
-        Data = 1 << 12
+        Data = 1 << 12,
+
+        // Predicate observations.  These only record that a comparison was
+        // made, and the observer keeps what was compared against and what
+        // the answer was.  A write touching one of these only invalidates
+        // if the answer would now be different.
+        ParentEquality = 1 << 13,
+        LabelInParentEquality = 1 << 14,
+        TagEquality = 1 << 15,
+
+        // Coarse observation for the ranges over a node's children, labels,
+        // or subtree: anything added to or removed from under this node.
+        Children = 1 << 16
     };
 
 private:
-    std::unordered_set<NodePrivate const *> _watchedRoots;
-    QReadWriteLock mutable _mapLock;
-    optional<std::unordered_map<NodePrivate const *, SeenFlags>> _map;
+    // Kept with their slots, so that a watched root which has been freed is
+    // recognized as such instead of being looked at
+    struct WatchedRoot {
+        NodePrivate const * _node;
+        quint32 _slot;
+    };
+    std::vector<WatchedRoot> _watchedRoots;
+
+    // Recording a read has to be cheaper than the read itself, so it does
+    // not touch any shared structure.  Each thread that records into an
+    // observer gets its own buffer, and appends (slot, flags) pairs to it
+    // under a flag that only that thread and a merge ever contend for.
+    //
+    // The buffers are folded into the table lazily: when one fills up, or
+    // when a write needs to know what has been seen.  The table is indexed
+    // by the node's slot (see NodePool) and split into fixed-size pages,
+    // so it's a direct array access with no hashing and no per-node heap
+    // allocations.  Slots are reused, so a stale entry left by a freed
+    // node can cause a false positive--never a missed invalidation.
+
+    struct SeenEntry {
+        quint32 _slot;
+        quint32 _flags;
+    };
+
+    struct ThreadBuffer {
+        static size_t const capacity = 256;
+
+        std::thread::id _thread;
+        std::atomic_flag _busy;
+        size_t _count;
+        std::array<SeenEntry, capacity> _entries;
+
+        explicit ThreadBuffer (std::thread::id thread) :
+            _thread (thread),
+            _count (0)
+        {
+            _busy.clear();
+        }
+    };
+
+    static size_t const pageSize = 1024;
+
+    typedef std::array<quint32, pageSize> SeenPage;
+
+    // serial numbers let a thread's cached buffer pointer notice that the
+    // observer it belonged to is gone, even if the memory got reused
+    quint64 const _serial;
+
+    QMutex _buffersMutex;
+    std::vector<unique_ptr<ThreadBuffer>> _buffers;
+
+    QReadWriteLock mutable _tableLock;
+    std::vector<unique_ptr<SeenPage>> _pages;
+
+    std::atomic<bool> _blinded;
+
+    // Set while this observer is on the engine's list of observers with
+    // buffered reads that haven't been merged yet
+    std::atomic<bool> _dirty;
+
+    // The engine keeps a reverse index from node slot to the observers that
+    // have seen something about that node, and what.  These are the slots
+    // this observer has entries under, so it can take them back out.
+    struct Interest {
+        Observer * _observer;
+        quint32 _flags;
+    };
+
+    // A set, since an interest can be dropped and recorded again any number
+    // of times.  It may name slots whose interest is already gone.
+    QMutex _interestSlotsLock;
+    std::unordered_set<quint32> _interestSlots;
+
+    // An incremental observer is not blinded by a relevant write.  Only the
+    // observations that the write could have changed are dropped, and they
+    // are queued up for the client to collect with takeInvalidations().
+    std::atomic<bool> _incremental;
+
+    QMutex _invalidationsLock;
+    std::vector<std::pair<quint32, SeenFlags>> _invalidations;
+
+    // What the predicate observations compared against, by node slot.
+    // Exactly one of the optionals is set, depending on the kind.
+    struct Comparison {
+        SeenFlags _kind;
+        optional<Identity> _parent;
+        optional<Label> _label;
+        optional<Tag> _tag;
+        bool _result;
+    };
+
+    QMutex _comparisonsLock;
+    std::unordered_map<quint32, std::vector<Comparison>> _comparisons;
+
+    // Identities that were looked up through a node's tag, and the slots of
+    // the nodes whose tags named them.  Whether a node with that identity
+    // exists can change without any write to those nodes.  Guarded by the
+    // comparisons lock.
+    std::unordered_map<Identity, std::vector<quint32>> _identityLookups;
 
 
 // protected constructor, make_shared can't call it...
@@ -127,24 +240,56 @@ public:
     static Observer & current ();
 
 private:
-    void markBlind() {
-        {
-            QWriteLocker lock (&_mapLock);
-            _map = nullopt;
-        }
-
-        emit blinded();
-    }
+    void markBlind();
 
 signals:
     void blinded();
 
+    // Emitted by incremental observers when new invalidations are queued,
+    // at most once per write (or per Engine::batch())
+    void invalidated();
+
 public:
     bool isBlinded();
 
+    void setIncremental (bool incremental) {
+        _incremental = incremental;
+    }
+
+    bool isIncremental () const {
+        return _incremental;
+    }
+
+    // Hand back and clear what has been invalidated since the last call:
+    // each node, and which of the things seen about it may now be different.
+    // Everything else this observer saw is still good.  Nodes that have been
+    // freed in the meantime are left out.
+    std::vector<std::pair<Node<Accessor const>, SeenFlags>> takeInvalidations ();
+
 
 private:
-    SeenFlags getSeenFlags (NodePrivate const & node) const;
+    ThreadBuffer & bufferForThisThread ();
+
+    // Caller must hold the table lock for writing
+    void applyBuffer (ThreadBuffer & buffer);
+
+    void forgetInterests ();
+
+    void addComparison (NodePrivate const & node, Comparison && comparison);
+
+    void addIdentityLookup (Identity const & id, NodePrivate const & node);
+
+    // Remove from the hit flags any predicate observations whose answers
+    // come out the same against the node as it is now
+    SeenFlags narrowHit (quint32 slot, SeenFlags hit);
+
+    void invalidatePartially (
+        std::vector<std::pair<quint32, SeenFlags>> const & changes
+    );
+
+    void mergePending ();
+
+    SeenFlags getSeenFlags (NodePrivate const & node);
 
     void addSeenFlags (
         NodePrivate const & node,
@@ -270,6 +415,10 @@ public:
         methyl::Label const & label
     );
 
+    // CHILD, LABEL, AND SUBTREE RANGES
+
+    void children (methyl::NodePrivate const & thisNode);
+
     // NODE IN LABEL ENUMERATION
 
     void firstChildInLabel (
@@ -310,6 +459,50 @@ public:
     );
 
 
+private:
+    typedef std::pair<NodePrivate const *, SeenFlags> Invalidation;
+
+    static void drainDirtyObservers ();
+
+public:
+    // What a write changed, recorded by slot along with the root of the tree
+    // it happened in.  (Public only so the per-thread batch can hold them.)
+    // The root of the tree the write was made in, and for writes that move
+    // a subtree between trees, the roots it left or joined (else null)
+    struct SlotChange {
+        quint32 _slot;
+        SeenFlags _flags;
+        std::array<NodePrivate const *, 3> _roots;
+    };
+
+private:
+    bool watches (SlotChange const & change) const;
+
+    static void invalidate (
+        std::vector<Invalidation> const & changes,
+        NodePrivate const & where,
+        NodePrivate const * movedFrom = nullptr,
+        NodePrivate const * movedTo = nullptr
+    );
+
+    static void invalidateSlots (std::vector<SlotChange> const & changes);
+
+    // See Engine::batch()
+    static void beginBatch ();
+
+    static void endBatch ();
+
+    // For when the batch is being left by an exception: like endBatch(),
+    // but if checking the writes fails, every observer is blinded instead.
+    static void endBatchUnwinding () noexcept;
+
+public:
+    // Called as nodes are freed, before their slots can be reused
+    static void forgetSlots (std::vector<quint32> const & slots);
+
+    // Called when nodes with these identities start or stop being findable
+    static void identitiesChanged (std::vector<Identity> const & ids);
+
 public:
     static void setTag (
         methyl::NodePrivate const & thisNode,
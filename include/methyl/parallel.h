@@ -0,0 +1,127 @@
+//
+// parallel.h
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#ifndef METHYL_PARALLEL_H
+#define METHYL_PARALLEL_H
+
+#include <QtConcurrent>
+
+#include <vector>
+
+#include "methyl/engine.h"
+
+namespace methyl {
+
+//
+// Read-only walks of a subtree spread across the global QThreadPool.
+//
+// The tree is cut into pieces breadth-first: starting from the root, nodes
+// are opened up (their children becoming pieces of their own) until there
+// are several pieces per thread or nothing left to open.  A wide label gets
+// spread across many pieces right away, and a deep single branch keeps
+// getting opened up until it fans out--but only so many levels down, so a
+// long chain costs a bounded amount of splitting and is then walked as a
+// whole.  The opened-up nodes are visited individually, and everything else
+// as a whole subtree in preorder.  Having many more pieces than threads
+// lets the pool balance the load.
+//
+// The observer in effect on the calling thread is put into effect on the
+// worker threads, so reads made by fn are recorded against it.  Observers
+// already take reads from any number of threads; the reverse index and
+// the engine's observer list are only locked by writes.
+//
+// Nothing may write to the tree while a walk is in progress.
+//
+
+struct ParallelPiece {
+    NodeView<Accessor const> _view;
+    bool _wholeSubtree;
+    size_t _index;
+};
+
+std::vector<ParallelPiece> splitForParallel (
+    NodeView<Accessor const> const & root
+);
+
+
+// fn gets each node of the subtree (as a NodeView<Accessor const>) exactly
+// once, in no particular order and on no particular thread.  Like
+// splitForParallel, this takes a view, and a Node or Tree converts to one.
+template <class Fn>
+void parallelForEach (NodeView<Accessor const> const & root, Fn && fn) {
+    Observer & observer = Observer::current();
+
+    std::vector<ParallelPiece> pieces = splitForParallel(root);
+
+    QtConcurrent::blockingMap(pieces, [&](ParallelPiece & piece) {
+        Engine::ObserverScope scope (observer);
+
+        if (not piece._wholeSubtree) {
+            fn(piece._view);
+            return;
+        }
+
+        auto walk = piece._view->traverse(TraversalOrder::Preorder);
+        while (auto current = walk.next())
+            fn(*current);
+    });
+}
+
+
+// Maps every node of the subtree and combines the results.  Since the
+// nodes are visited in no particular order, reduce must be associative and
+// commutative, and identity must be its identity element.
+template <class Result, class Map, class Reduce>
+Result parallelReduce (
+    NodeView<Accessor const> const & root,
+    Result const & identity,
+    Map && map,
+    Reduce && reduce
+) {
+    Observer & observer = Observer::current();
+
+    std::vector<ParallelPiece> pieces = splitForParallel(root);
+    std::vector<Result> partials (pieces.size(), identity);
+
+    QtConcurrent::blockingMap(pieces, [&](ParallelPiece & piece) {
+        Engine::ObserverScope scope (observer);
+
+        Result & partial = partials[piece._index];
+
+        if (not piece._wholeSubtree) {
+            partial = reduce(partial, map(piece._view));
+            return;
+        }
+
+        auto walk = piece._view->traverse(TraversalOrder::Preorder);
+        while (auto current = walk.next())
+            partial = reduce(partial, map(*current));
+    });
+
+    Result result = identity;
+    for (Result const & partial : partials)
+        result = reduce(result, partial);
+    return result;
+}
+
+} // end namespace methyl
+
+#endif // METHYL_PARALLEL_H
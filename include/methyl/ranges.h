@@ -0,0 +1,342 @@
+//
+// ranges.h
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#ifndef METHYL_RANGES_H
+#define METHYL_RANGES_H
+
+#include <iterator>
+
+#include "methyl/nodeprivate.h"
+#include "methyl/observer.h"
+#include "methyl/nodeview.h"
+
+namespace methyl {
+
+//
+// Ranges over the labels of a node, the children in one of its labels, and
+// the nodes of a subtree, for use with range-based for and <algorithm>.
+//
+// Walking children by hand through the Accessor means a trip through the
+// observer and a label table lookup for every step (hasLabelAfter, then
+// labelAfter, then hasNextSiblingInLabel...).  These ranges instead record
+// a single SeenFlags::Children observation on the node they cover, which is
+// invalidated by any insert or detach under it, and then step along the
+// NodePrivate links directly.
+//
+// LabelRange walks the node's label table, which is an array, so it is
+// random access.  The children in a label are a linked list, and the table
+// only knows the first and last of them, so ChildRange stays bidirectional
+// and PreorderRange forward.  Giving them random access would mean keeping
+// an array of children per label, which every insert and detach would pay
+// to maintain; copy a ChildRange into a std::vector to sort or index it.
+// Child and subtree ranges yield NodeViews, so they are only good while
+// the node they were taken from is held by a Node or Tree.
+//
+// T is Accessor or Accessor const, and decides whether the views are
+// mutable.  Don't insert or detach under the node while iterating.
+//
+
+class LabelRange final {
+private:
+    NodePrivate::label_table const * _table;
+
+public:
+    class iterator final {
+    friend class LabelRange;
+    private:
+        NodePrivate::label_table::const_iterator _iter;
+
+        explicit iterator (NodePrivate::label_table::const_iterator iter) :
+            _iter (iter)
+        {
+        }
+
+    public:
+        iterator () = default;
+
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef Label value_type;
+        typedef ptrdiff_t difference_type;
+        typedef Label const * pointer;
+        typedef Label const & reference;
+
+        reference operator* () const { return _iter->first; }
+
+        pointer operator-> () const { return &_iter->first; }
+
+        iterator & operator++ () { ++_iter; return *this; }
+
+        iterator operator++ (int) { iterator old = *this; ++_iter; return old; }
+
+        iterator & operator-- () { --_iter; return *this; }
+
+        iterator operator-- (int) { iterator old = *this; --_iter; return old; }
+
+        iterator & operator+= (difference_type n) { _iter += n; return *this; }
+
+        iterator & operator-= (difference_type n) { _iter -= n; return *this; }
+
+        iterator operator+ (difference_type n) const {
+            return iterator (_iter + n);
+        }
+
+        friend iterator operator+ (difference_type n, iterator const & iter) {
+            return iter + n;
+        }
+
+        iterator operator- (difference_type n) const {
+            return iterator (_iter - n);
+        }
+
+        difference_type operator- (iterator const & other) const {
+            return _iter - other._iter;
+        }
+
+        reference operator[] (difference_type n) const {
+            return _iter[n].first;
+        }
+
+        bool operator== (iterator const & other) const {
+            return _iter == other._iter;
+        }
+
+        bool operator!= (iterator const & other) const {
+            return _iter != other._iter;
+        }
+
+        bool operator< (iterator const & other) const {
+            return _iter < other._iter;
+        }
+
+        bool operator> (iterator const & other) const {
+            return _iter > other._iter;
+        }
+
+        bool operator<= (iterator const & other) const {
+            return _iter <= other._iter;
+        }
+
+        bool operator>= (iterator const & other) const {
+            return _iter >= other._iter;
+        }
+    };
+
+    explicit LabelRange (NodePrivate const & node) :
+        _table (&node._labelToChildren)
+    {
+        node.materialize();
+        Observer::current().children(node);
+    }
+
+    iterator begin () const { return iterator (_table->begin()); }
+
+    iterator end () const { return iterator (_table->end()); }
+
+    size_t size () const { return _table->size(); }
+
+    bool empty () const { return _table->empty(); }
+
+    Label const & operator[] (size_t index) const {
+        return begin()[index];
+    }
+};
+
+
+
+template <class T>
+class ChildRange final {
+    static_assert(
+        std::is_same<typename std::remove_const<T>::type, Accessor>::value,
+        "ChildRange<> is over untyped nodes, use Accessor or Accessor const"
+    );
+
+private:
+    NodePrivate * _first;
+    NodePrivate * _last;
+
+public:
+    class iterator final {
+    friend class ChildRange;
+    private:
+        NodeView<T> _view;
+        NodePrivate * _last;
+
+        iterator (NodePrivate * node, NodePrivate * last) :
+            _view (node),
+            _last (last)
+        {
+        }
+
+    public:
+        iterator () :
+            _view (nullptr),
+            _last (nullptr)
+        {
+        }
+
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef NodeView<T> value_type;
+        typedef ptrdiff_t difference_type;
+        typedef NodeView<T> const * pointer;
+        typedef NodeView<T> const & reference;
+
+        reference operator* () const { return _view; }
+
+        pointer operator-> () const { return &_view; }
+
+        // Sibling links run on past the end of the label into the next
+        // one, so the end of the range has to be spotted by address
+        iterator & operator++ () {
+            NodePrivate * node = _view._nodePrivate;
+            _view._nodePrivate = (node == _last) ? nullptr : node->_nextSibling;
+            return *this;
+        }
+
+        iterator operator++ (int) { iterator old = *this; ++*this; return old; }
+
+        iterator & operator-- () {
+            NodePrivate * node = _view._nodePrivate;
+            _view._nodePrivate = node ? node->_previousSibling : _last;
+            return *this;
+        }
+
+        iterator operator-- (int) { iterator old = *this; --*this; return old; }
+
+        bool operator== (iterator const & other) const {
+            return _view == other._view;
+        }
+
+        bool operator!= (iterator const & other) const {
+            return _view != other._view;
+        }
+    };
+
+    ChildRange (NodePrivate const & node, Label const & label) :
+        _first (nullptr),
+        _last (nullptr)
+    {
+        node.materialize();
+        Observer::current().children(node);
+
+        auto iter = node._labelToChildren.find(label);
+        if (iter != node._labelToChildren.end()) {
+            _first = iter->second._first;
+            _last = iter->second._last;
+        }
+    }
+
+    iterator begin () const { return iterator (_first, _last); }
+
+    iterator end () const { return iterator (nullptr, _last); }
+
+    bool empty () const { return _first == nullptr; }
+};
+
+
+
+template <class T>
+class PreorderRange final {
+    static_assert(
+        std::is_same<typename std::remove_const<T>::type, Accessor>::value,
+        "PreorderRange<> is over untyped nodes, use Accessor or Accessor const"
+    );
+
+private:
+    NodePrivate * _root;
+
+    // Looked up once for the walk rather than once per step
+    Observer * _observer;
+
+public:
+    class iterator final {
+    friend class PreorderRange;
+    private:
+        NodeView<T> _view;
+        NodePrivate const * _root;
+        Observer * _observer;
+
+        iterator (
+            NodePrivate * node,
+            NodePrivate const * root,
+            Observer * observer
+        ) :
+            _view (node),
+            _root (root),
+            _observer (observer)
+        {
+        }
+
+    public:
+        iterator () :
+            _view (nullptr),
+            _root (nullptr),
+            _observer (nullptr)
+        {
+        }
+
+        typedef std::forward_iterator_tag iterator_category;
+        typedef NodeView<T> value_type;
+        typedef ptrdiff_t difference_type;
+        typedef NodeView<T> const * pointer;
+        typedef NodeView<T> const & reference;
+
+        reference operator* () const { return _view; }
+
+        pointer operator-> () const { return &_view; }
+
+        // Each node's children are observed as the walk reaches it, which
+        // covers every node whose children the walk depends on
+        iterator & operator++ () {
+            NodePrivate * next = _view._nodePrivate
+                ->maybeNextPreorderNodeUnderRoot(*_root);
+            if (next)
+                _observer->children(*next);
+            _view._nodePrivate = next;
+            return *this;
+        }
+
+        iterator operator++ (int) { iterator old = *this; ++*this; return old; }
+
+        bool operator== (iterator const & other) const {
+            return _view == other._view;
+        }
+
+        bool operator!= (iterator const & other) const {
+            return _view != other._view;
+        }
+    };
+
+    explicit PreorderRange (NodePrivate const & root) :
+        _root (const_cast<NodePrivate *>(&root)),
+        _observer (&Observer::current())
+    {
+        root.materialize();
+        _observer->children(root);
+    }
+
+    iterator begin () const { return iterator (_root, _root, _observer); }
+
+    iterator end () const { return iterator (nullptr, _root, _observer); }
+};
+
+} // end namespace methyl
+
+#endif // METHYL_RANGES_H
@@ -27,6 +27,7 @@
 
 #include "methyl/defs.h"
 #include "methyl/identity.h"
+#include "methyl/atomtable.h"
 
 
 namespace methyl {
@@ -58,21 +59,44 @@ namespace methyl {
 // arbitrary URI as an ID.
 //
 
+class TagLiteral;
+class LabelLiteral;
+class Journal;
+
 class Tag {
 
 friend struct ::std::hash<Tag>;
+friend class TagLiteral;
+friend class LabelLiteral;
+friend class Journal;
 private:
-    optional<QString> _urlString;
-    optional<QUuid> _uuid;
+    // A URL is an atom (see AtomTable), and equal URLs always have the same
+    // atom.  A UUID is carried inline instead, with _atom set to noAtom;
+    // there are as many of those as nodes with identities, and interning
+    // them would mean a table entry per node that could never be freed.
+    quint32 _atom;
+    QUuid _uuid;
+
+    bool isUuid () const {
+        return _atom == AtomTable::noAtom;
+    }
+
+    QString const & urlString () const {
+        return AtomTable::url(_atom);
+    }
+
+    struct FromAtom {};
+
+    Tag (quint32 atom, FromAtom) :
+        _atom (atom)
+    {
+    }
 
 public:
     explicit Tag (
         QString const & urlString,
         QUrl::ParsingMode /* mode = QUrl::StrictMode */
-    ) :
-        _urlString (urlString),
-        _uuid ()
-    {
+    ) {
         // We need to check if this url is a special case of a UUID URN,
         // in which case we resolve it as an ID.  We don't output lowercase,
         // but we tolerate it on read:
@@ -82,19 +106,20 @@ public:
         // lowercase letters."
 
         static QString const urnPrefix = "urn:uuid:";
-        if (not urlString.startsWith(urnPrefix, Qt::CaseInsensitive))
+        if (not urlString.startsWith(urnPrefix, Qt::CaseInsensitive)) {
+            _atom = AtomTable::instance().intern(urlString);
             return;
+        }
 
+        _atom = AtomTable::noAtom;
         _uuid = QUuid (urlString.mid(
             urnPrefix.length(), urlString.length() - urnPrefix.length()
         ));
-        hopefully(not (*_uuid).isNull(), HERE);
-
-        _urlString = nullopt;
+        hopefully(not _uuid.isNull(), HERE);
     }
 
     explicit Tag (QUuid const & uuid) :
-        _urlString(),
+        _atom (AtomTable::noAtom),
         _uuid (uuid)
     {
     }
@@ -130,87 +155,183 @@ public:
 
 public:
     QUrl toUrl () const {
-        if (_uuid)
-            return QUrl("urn:uuid:" + (*_uuid).toString());
+        if (isUuid())
+            return QUrl("urn:uuid:" + _uuid.toString());
 
         // Shouldn't need QUrl::StrictMode since we check isValid on
         // the construction of the Tag if it was a Url.
-        return QUrl(*_urlString);
+        return QUrl(urlString());
     }
 
     optional<Identity> maybeAsIdentity () const {
-        if (not _uuid)
+        if (not isUuid())
             return nullopt;
 
-        return Identity (*_uuid);
+        return Identity (_uuid);
     }
 
 
     bool operator== (Tag const & rhs) const {
-        if (this->_uuid) {
-            if (rhs._uuid)
-                return *this->_uuid == *rhs._uuid;
-
-            return false;
-        }
-
-        if (rhs._uuid)
+        if (_atom != rhs._atom)
             return false;
-
-        return *this->_urlString == *rhs._urlString;
+        return not isUuid() or _uuid == rhs._uuid;
     }
 
     bool operator!= (Tag const & rhs) const {
-        if (this->_uuid) {
-            if (rhs._uuid)
-                return *this->_uuid != *rhs._uuid;
+        return not (*this == rhs);
+    }
 
-            return true;
+    // The one order on tags, used both for sorting labels in a node and for
+    // ranking trees (NodePrivate::compare).  Negative means this one comes
+    // first.  All UUIDs come before all URLs, and UUIDs are in descending
+    // order.  URLs are in the order of the FNV-1a hash of their UTF-8 text
+    // (which the AtomTable keeps with each atom), and only two URLs whose
+    // hashes collide are ordered by their strings.  That isn't alphabetical,
+    // but it is the same from one run to the next, and it almost never has
+    // to look at a string.
+    int compare (Tag const & other) const {
+        if (isUuid()) {
+            if (other.isUuid()) {
+                if (_uuid > other._uuid)
+                    return -1;
+
+                if (_uuid == other._uuid)
+                    return 0;
+
+                return 1;
+            }
+
+            return -1;
         }
 
-        if (rhs._uuid)
-            return true;
+        if (other.isUuid())
+            return 1;
+
+        if (_atom == other._atom)
+            return 0;
+
+        quint64 const hash = AtomTable::hash(_atom);
+        quint64 const otherHash = AtomTable::hash(other._atom);
+        if (hash != otherHash)
+            return hash < otherHash ? -1 : 1;
 
-        return *this->_urlString != *rhs._urlString;
+        return urlString().compare(other.urlString());
     }
 
     bool operator< (Tag const & rhs) const {
-        if (this->_uuid) {
-            if (rhs._uuid)
-                return *this->_uuid < *rhs._uuid;
+        return compare(rhs) < 0;
+    }
+};
 
-            return false;
-        }
 
-        if (rhs._uuid)
-            return false;
+//
+// TagLiteral
+//
+// A Tag known at compile time, for globals.  Making a Tag at static init
+// time means string work and an AtomTable lookup before main() even runs,
+// for every tag the program defines.  A TagLiteral is just the URL (which
+// may be a "urn:uuid:" URN) and a constexpr constructor, so it costs
+// nothing until it is first used.  Then a URL's atom is looked up once and
+// cached, and every later use is an atomic load.  A UUID has no atom to
+// cache, so a "urn:uuid:" literal is parsed again each time it is used.
+//
+//     TagLiteral const globalTagComment ("http://example.com/comment");
+//
+// It converts implicitly wherever a Tag is expected, and compares with a
+// Tag from either side.  hash() is the FNV-1a hash of the URL text, worked
+// out at compile time.  It is the same hash the AtomTable keys URLs by, so
+// the one lookup a literal ever does skips hashing the string at runtime.
+// After that a literal is just its atom; using one as a key (in a label
+// table, say) compares and hashes that integer like any other Tag does.
+//
+
+class TagLiteral final {
+private:
+    char const * _url;
+    quint64 _hash;
+    bool _isUuid;
+
+    // Atom plus one, so zero can mean "not looked up yet"
+    std::atomic<quint32> mutable _atomPlusOne;
 
-        return *this->_urlString < *rhs._urlString;
+    static constexpr bool hasPrefix (char const * text, char const * prefix) {
+        return *prefix == '\0'
+            ? true
+            : (*text | 0x20) == *prefix and hasPrefix(text + 1, prefix + 1);
     }
 
-    int compare (Tag const & other) const {
-        if (this->_uuid) {
-            if (other._uuid) {
-                if (*this->_uuid > *other._uuid)
-                    return -1;
+    static constexpr quint64 fnv1a (char const * text, quint64 hash) {
+        return *text == '\0'
+            ? hash
+            : fnv1a(
+                text + 1,
+                (hash ^ static_cast<unsigned char>(*text)) * 1099511628211ULL
+            );
+    }
 
-                if (*this->_uuid == *other._uuid)
-                    return 0;
+public:
+    constexpr explicit TagLiteral (char const * url) :
+        _url (url),
+        _hash (fnv1a(url, 14695981039346656037ULL)),
+        _isUuid (hasPrefix(url, "urn:uuid:")),
+        _atomPlusOne (0)
+    {
+    }
 
-                return 1;
-            }
+    TagLiteral (TagLiteral const &) = delete;
 
-            // rule is all UUIDs come after all URLs.
-            return -1;
-        }
+    TagLiteral & operator= (TagLiteral const &) = delete;
 
-        if (other._uuid)
-            return 1;
+    constexpr char const * url () const {
+        return _url;
+    }
+
+    constexpr quint64 hash () const {
+        return _hash;
+    }
+
+    // Two threads racing to resolve will get the same atom from the table,
+    // so it doesn't matter which store wins
+    Tag tag () const {
+        quint32 cached = _atomPlusOne.load(std::memory_order_acquire);
+        if (cached != 0)
+            return Tag (cached - 1, Tag::FromAtom ());
+
+        if (_isUuid)
+            return Tag (QString (_url), QUrl::StrictMode);
+
+        quint32 const atom = AtomTable::instance().intern(
+            QString (_url), _hash
+        );
+        _atomPlusOne.store(atom + 1, std::memory_order_release);
+        return Tag (atom, Tag::FromAtom ());
+    }
 
-        return (*this->_urlString).compare(*other._urlString);
+    operator Tag () const {
+        return tag();
     }
 };
 
+
+// Tag's own comparisons are members, which won't convert a literal on the
+// left-hand side, so globalTagError == tag needs these.
+
+inline bool operator== (TagLiteral const & left, Tag const & right) {
+    return left.tag() == right;
+}
+
+inline bool operator== (Tag const & left, TagLiteral const & right) {
+    return left == right.tag();
+}
+
+inline bool operator!= (TagLiteral const & left, Tag const & right) {
+    return left.tag() != right;
+}
+
+inline bool operator!= (Tag const & left, TagLiteral const & right) {
+    return left != right.tag();
+}
+
 } // end namespace methyl
 
 
@@ -226,10 +347,9 @@ namespace std {
             methyl::Tag const & tag
         ) const
         {
-            if (tag._uuid)
-                return qHash(*tag._uuid);
-
-            return qHash(*tag._urlString);
+            if (tag.isUuid())
+                return qHash(tag._uuid);
+            return hash<quint32>()(tag._atom);
         }
     };
 } // end namespace std
@@ -0,0 +1,244 @@
+//
+// traversal.h
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#ifndef METHYL_TRAVERSAL_H
+#define METHYL_TRAVERSAL_H
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "methyl/nodeprivate.h"
+#include "methyl/observer.h"
+#include "methyl/nodeview.h"
+
+namespace methyl {
+
+enum class TraversalOrder {
+    Preorder,
+    Postorder,
+    BreadthFirst
+};
+
+
+//
+// A Traversal is a cursor for walking a subtree in preorder, postorder, or
+// breadth-first order.  Call next() until it comes back empty:
+//
+//     auto walk = node->traverse(TraversalOrder::Preorder);
+//     while (auto current = walk.next()) {
+//         if ((*current)->hasTagEqualTo(globalTagComment))
+//             walk.skipSubtree();
+//     }
+//
+// skipSubtree() keeps the walk from going beneath the node next() returned
+// last (it has no meaning in postorder, where the node's children have
+// already been visited).  stop() ends the walk early.
+//
+// If labels are given, only children in those labels are visited (the root
+// is always visited).  Without them the walk simply follows the sibling
+// links, which run across label boundaries.  With them, the parent's label
+// table is only consulted when the walk reaches the end of a label's run
+// of children--never once per node.
+//
+// Preorder and postorder keep no stack; the cursor's position in the tree
+// is enough to find the next node.  Breadth-first has to queue up the
+// nodes of the next level.
+//
+// Like the ranges, each node has its children observed once as the walk
+// reaches it, and the results are NodeViews.  Don't insert or detach
+// under the root while walking.
+//
+
+template <class T>
+class Traversal final {
+    static_assert(
+        std::is_same<typename std::remove_const<T>::type, Accessor>::value,
+        "Traversal<> is over untyped nodes, use Accessor or Accessor const"
+    );
+
+private:
+    NodePrivate * _root;
+    TraversalOrder _order;
+    std::vector<Label> _labels;
+
+    NodePrivate * _current;
+    bool _started;
+    bool _skip;
+    bool _stopped;
+
+    std::deque<NodePrivate *> _queue;
+
+    // Looked up once for the walk rather than once per step
+    Observer * _observer;
+
+private:
+    bool accepts (Label const & label) const {
+        return _labels.empty()
+            or std::find(_labels.begin(), _labels.end(), label)
+                != _labels.end();
+    }
+
+    NodePrivate * maybeFirstChildOf (NodePrivate const & node) const {
+        _observer->children(node);
+
+        if (_labels.empty())
+            return node.maybeFirstChild();
+
+        for (auto const & entry : node._labelToChildren) {
+            if (accepts(entry.first))
+                return entry.second._first;
+        }
+        return nullptr;
+    }
+
+    NodePrivate * maybeNextSiblingOf (NodePrivate const & node) const {
+        NodePrivate * next = node._nextSibling;
+        if (_labels.empty())
+            return next;
+
+        if (next and *next->_labelInParent == *node._labelInParent)
+            return next;
+
+        // End of this label's children; find the next label we want
+        auto const & table = node._parent->_labelToChildren;
+        auto iter = table.find(*node._labelInParent);
+        for (++iter; iter != table.end(); ++iter) {
+            if (accepts(iter->first))
+                return iter->second._first;
+        }
+        return nullptr;
+    }
+
+    NodePrivate * deepestFirstDescendant (NodePrivate * node) const {
+        while (NodePrivate * child = maybeFirstChildOf(*node))
+            node = child;
+        return node;
+    }
+
+    NodePrivate * advancePreorder () {
+        if (not _skip) {
+            if (NodePrivate * child = maybeFirstChildOf(*_current))
+                return child;
+        }
+
+        NodePrivate const * node = _current;
+        while (node != _root) {
+            if (NodePrivate * sibling = maybeNextSiblingOf(*node))
+                return sibling;
+            node = node->_parent;
+        }
+        return nullptr;
+    }
+
+    NodePrivate * advancePostorder () {
+        if (_current == _root)
+            return nullptr;
+
+        if (NodePrivate * sibling = maybeNextSiblingOf(*_current))
+            return deepestFirstDescendant(sibling);
+        return _current->_parent;
+    }
+
+    NodePrivate * advanceBreadthFirst () {
+        if (not _skip) {
+            NodePrivate * child = maybeFirstChildOf(*_current);
+            while (child) {
+                _queue.push_back(child);
+                child = maybeNextSiblingOf(*child);
+            }
+        }
+
+        if (_queue.empty())
+            return nullptr;
+
+        NodePrivate * result = _queue.front();
+        _queue.pop_front();
+        return result;
+    }
+
+public:
+    Traversal (
+        NodePrivate const & root,
+        TraversalOrder order,
+        std::vector<Label> labels
+    ) :
+        _root (const_cast<NodePrivate *>(&root)),
+        _order (order),
+        _labels (std::move(labels)),
+        _current (nullptr),
+        _started (false),
+        _skip (false),
+        _stopped (false),
+        _observer (&Observer::current())
+    {
+        root.materialize();
+    }
+
+    optional<NodeView<T>> next () {
+        if (_stopped)
+            return nullopt;
+
+        if (not _started) {
+            _started = true;
+            if (_order == TraversalOrder::Postorder)
+                _current = deepestFirstDescendant(_root);
+            else
+                _current = _root;
+        } else {
+            switch (_order) {
+            case TraversalOrder::Preorder:
+                _current = advancePreorder();
+                break;
+            case TraversalOrder::Postorder:
+                _current = advancePostorder();
+                break;
+            case TraversalOrder::BreadthFirst:
+                _current = advanceBreadthFirst();
+                break;
+            default:
+                throw hopefullyNotReached(HERE);
+            }
+            _skip = false;
+        }
+
+        if (not _current) {
+            _stopped = true;
+            return nullopt;
+        }
+        return NodeView<T> (_current);
+    }
+
+    void skipSubtree () {
+        hopefully(_order != TraversalOrder::Postorder, HERE);
+        hopefully(_current != nullptr, HERE);
+        _skip = true;
+    }
+
+    void stop () {
+        _stopped = true;
+        _queue.clear();
+    }
+};
+
+} // end namespace methyl
+
+#endif // METHYL_TRAVERSAL_H
@@ -104,7 +104,7 @@ private:
 
 private:
     unique_ptr<NodePrivate> extractNodePrivate() {
-        NodePrivate & node = accessor().nodePrivate();
+        NodePrivate & node = accessor().nodePrivateAsIs();
         // REVIEW: We keep the context alive so constructors can extract it out
         // but is this the best way of doing it?
         shared_ptr<Context> context = accessor().context();
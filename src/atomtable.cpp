@@ -0,0 +1,198 @@
+//
+// atomtable.cpp
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#include "methyl/atomtable.h"
+
+namespace methyl {
+
+AtomTable::Index::Index (size_t capacity) :
+    _mask (capacity - 1),
+    _slots (new std::atomic<quint64>[capacity])
+{
+    for (size_t slot = 0; slot < capacity; slot++)
+        _slots[slot].store(0, std::memory_order_relaxed);
+}
+
+
+AtomTable::AtomTable () :
+    _count (0)
+{
+    for (auto & directory : _directories)
+        directory.store(nullptr, std::memory_order_relaxed);
+
+    _indexes.emplace_back(new Index (pageSize));
+    _index.store(_indexes.back().get(), std::memory_order_release);
+}
+
+
+AtomTable & AtomTable::instance () {
+    // Deliberately never destroyed, so tags in other static objects can
+    // still be read during shutdown
+    static AtomTable * table = new AtomTable;
+    return *table;
+}
+
+
+quint64 AtomTable::hashOf (QString const & urlString) {
+    quint64 hash = 14695981039346656037ULL;
+    auto mix = [&](uint byte) {
+        hash = (hash ^ byte) * 1099511628211ULL;
+    };
+
+    int const length = urlString.length();
+    for (int index = 0; index < length; index++) {
+        uint code = urlString[index].unicode();
+        if (
+            code >= 0xD800 and code < 0xDC00 and index + 1 < length
+            and urlString[index + 1].unicode() >= 0xDC00
+            and urlString[index + 1].unicode() < 0xE000
+        ) {
+            index++;
+            code = 0x10000 + ((code - 0xD800) << 10)
+                + (urlString[index].unicode() - 0xDC00);
+        }
+
+        if (code < 0x80)
+            mix(code);
+        else if (code < 0x800) {
+            mix(0xC0 | (code >> 6));
+            mix(0x80 | (code & 0x3F));
+        }
+        else if (code < 0x10000) {
+            mix(0xE0 | (code >> 12));
+            mix(0x80 | ((code >> 6) & 0x3F));
+            mix(0x80 | (code & 0x3F));
+        }
+        else {
+            mix(0xF0 | (code >> 18));
+            mix(0x80 | ((code >> 12) & 0x3F));
+            mix(0x80 | ((code >> 6) & 0x3F));
+            mix(0x80 | (code & 0x3F));
+        }
+    }
+    return hash;
+}
+
+
+quint32 AtomTable::find (
+    Index const & index,
+    QString const & urlString,
+    quint64 fullHash
+) const {
+    quint32 const hash = foldHash(fullHash);
+    size_t position = hash & index._mask;
+    while (true) {
+        quint64 const word = index._slots[position].load(
+            std::memory_order_acquire
+        );
+        if (word == 0)
+            return noAtom;
+
+        quint32 const id = static_cast<quint32>(word) - 1;
+        if (static_cast<quint32>(word >> 32) == hash and url(id) == urlString)
+            return id;
+
+        position = (position + 1) & index._mask;
+    }
+}
+
+
+void AtomTable::place (Index & index, quint64 fullHash, quint32 id) {
+    quint32 const hash = foldHash(fullHash);
+    size_t position = hash & index._mask;
+    while (index._slots[position].load(std::memory_order_relaxed) != 0)
+        position = (position + 1) & index._mask;
+
+    index._slots[position].store(
+        (static_cast<quint64>(hash) << 32) | (id + 1),
+        std::memory_order_release
+    );
+}
+
+
+quint32 AtomTable::add (QString const & urlString, quint64 hash) {
+    // caller holds the lock
+    quint32 const id = _count;
+    hopefully(id != noAtom, "Too many distinct tags", HERE);
+
+    auto & directorySlot = _directories[id / (pageSize * pagesPerDirectory)];
+    Directory * directory = directorySlot.load(std::memory_order_relaxed);
+    if (not directory) {
+        directory = new Directory;
+        for (auto & page : *directory)
+            page.store(nullptr, std::memory_order_relaxed);
+        directorySlot.store(directory, std::memory_order_release);
+    }
+
+    auto & pageSlot = (*directory)[(id / pageSize) % pagesPerDirectory];
+    Atom * entries = pageSlot.load(std::memory_order_relaxed);
+    if (not entries) {
+        entries = new Atom[pageSize];
+        pageSlot.store(entries, std::memory_order_release);
+    }
+
+    // Nobody can find this id until it is placed in the index below, so
+    // filling the entry in after the page is visible is safe
+    entries[id % pageSize] = Atom {urlString, hash};
+    _count++;
+
+    // Keep the index at most half full.  A bigger one is filled in before
+    // it is published, and the old one stays around for readers in it.
+    Index * index = _index.load(std::memory_order_relaxed);
+    if (static_cast<size_t>(_count) * 2 > index->_mask + 1) {
+        _indexes.emplace_back(new Index ((index->_mask + 1) * 2));
+        index = _indexes.back().get();
+        for (quint32 existing = 0; existing < _count; existing++)
+            place(*index, AtomTable::hash(existing), existing);
+        _index.store(index, std::memory_order_release);
+    }
+    else
+        place(*index, hash, id);
+
+    return id;
+}
+
+
+quint32 AtomTable::intern (QString const & urlString) {
+    return intern(urlString, hashOf(urlString));
+}
+
+
+quint32 AtomTable::intern (QString const & urlString, quint64 hash) {
+    quint32 const found = find(
+        *_index.load(std::memory_order_acquire), urlString, hash
+    );
+    if (found != noAtom)
+        return found;
+
+    QMutexLocker lock (&_lock);
+
+    // May have been added since the search above
+    quint32 const id = find(
+        *_index.load(std::memory_order_relaxed), urlString, hash
+    );
+    if (id != noAtom)
+        return id;
+
+    return add(urlString, hash);
+}
+
+} // end namespace methyl
@@ -23,15 +23,25 @@
 
 namespace methyl {
 
-Label const globalLabelName (HERE);
+LabelLiteral const globalLabelName (
+    "http://methyl.hostilefork.com/label/name"
+);
 
 //
 // ERROR
 //
-Tag const globalTagError (HERE);
-Tag const globalTagCancellation (HERE);
-Label const globalLabelCausedBy (HERE);
-Label const globalLabelDescription (HERE);
+TagLiteral const globalTagError (
+    "http://methyl.hostilefork.com/tag/error"
+);
+TagLiteral const globalTagCancellation (
+    "http://methyl.hostilefork.com/tag/cancellation"
+);
+LabelLiteral const globalLabelCausedBy (
+    "http://methyl.hostilefork.com/label/caused-by"
+);
+LabelLiteral const globalLabelDescription (
+    "http://methyl.hostilefork.com/label/description"
+);
 
 
 Tree<Error> Error::create (
@@ -126,12 +136,27 @@ Engine::Engine (
     ContextGetter const & contextGetter,
     ObserverGetter const & observerGetter
 ) :
+    _identityMode (IdentityMode::Random),
+    _lazyIdentityIndex (false),
+    _identityEpoch (0),
+    _nextIdentityBlock (0),
     _contextGetter (contextGetter),
-    _observerGetter (observerGetter)
+    _observerGetter (observerGetter),
+    _deferredCount (0),
+    _nextRootEpochBlock (0),
+    _identityLookupCount (0)
 {
     hopefully(globalEngine == nullptr, HERE);
     globalEngine = this;
 
+    // One trip to the random number generator per session gives an epoch
+    // that keeps sequential identities from colliding with other sessions.
+    QUuid const seed = QUuid::createUuid();
+    _identityEpoch = (static_cast<quint64>(seed.data1) << 32)
+        ^ (static_cast<quint64>(seed.data2) << 16)
+        ^ seed.data3
+        ^ (static_cast<quint64>(seed.data4[0]) << 56);
+
     std::unordered_set<Node<Accessor const>> dummyWatchedRoots;
     _dummyObserver = Observer::create(dummyWatchedRoots, HERE);
     _dummyObserver->markBlind();
@@ -145,7 +170,43 @@ Engine::Engine (
     );
 }
 
+namespace {
+
+// Innermost ObserverScope and ContextScope on this thread, if any
+thread_local Observer * observerInScope = nullptr;
+thread_local shared_ptr<Context> const * contextInScope = nullptr;
+
+} // end anonymous namespace
+
+
+Engine::ObserverScope::ObserverScope (Observer & observer) :
+    _previous (observerInScope)
+{
+    observerInScope = &observer;
+}
+
+
+Engine::ObserverScope::~ObserverScope () {
+    observerInScope = _previous;
+}
+
+
+Engine::ContextScope::ContextScope (shared_ptr<Context> const & context) :
+    _previous (contextInScope)
+{
+    contextInScope = &context;
+}
+
+
+Engine::ContextScope::~ContextScope () {
+    contextInScope = _previous;
+}
+
+
 Observer & Engine::observerInEffect () {
+    if (observerInScope)
+        return *observerInScope;
+
     shared_ptr<Observer> observer = _observerGetter();
     if (observer)
         return *observer;
@@ -153,25 +214,80 @@ Observer & Engine::observerInEffect () {
 }
 
 shared_ptr<Context> Engine::contextForCreate() {
+    if (contextInScope)
+        return *contextInScope;
+
     // Should these be different?  Parameterized?
     return _contextGetter();
 }
 
 
 shared_ptr<Context> Engine::contextForLookup() {
+    if (contextInScope)
+        return *contextInScope;
+
     // Should these be different?  Parameterized?
     return _contextGetter();
 }
 
 
+Identity Engine::newIdentity () {
+    if (_identityMode == IdentityMode::Random)
+        return Identity (QUuid::createUuid());
+
+    // Each thread reserves a block of the counter at a time, so the shared
+    // atomic is only touched once per identityBlockSize nodes.
+    static quint64 const identityBlockSize = 1024;
+
+    struct IdentityBlock {
+        Engine * _engine = nullptr;
+        quint64 _next = 0;
+        quint64 _end = 0;
+    };
+    static thread_local IdentityBlock block;
+
+    if (block._engine != this or block._next == block._end) {
+        block._engine = this;
+        block._next = _nextIdentityBlock.fetch_add(identityBlockSize);
+        block._end = block._next + identityBlockSize;
+    }
+    return Identity::fromSequence(_identityEpoch, block._next++);
+}
+
+
+quint32 Engine::newRootEpoch () {
+    static quint32 const rootEpochBlockSize = 1024;
+
+    struct RootEpochBlock {
+        Engine * _engine = nullptr;
+        quint32 _next = 0;
+        quint32 _end = 0;
+    };
+    static thread_local RootEpochBlock block;
+
+    if (block._engine != this or block._next == block._end) {
+        block._engine = this;
+        block._next = _nextRootEpochBlock.fetch_add(rootEpochBlockSize);
+        block._end = block._next + rootEpochBlockSize;
+    }
+    return block._next++;
+}
+
+
 Tree<Accessor> Engine::makeNodeWithId (
     methyl::Identity const & id,
     methyl::Tag const & tag,
     optional<QString const &> name
 ) {
+    // cannot use make_unique here; private constructor
+    unique_ptr<NodePrivate> nodePrivate (new NodePrivate (id, tag));
+
+    // The caller already knows this id and may look it up, so it can't wait
+    // to be published (and a duplicate id should be caught right here).
+    nodePrivate->publishIdentity(HERE);
+
     auto nodeWithId = Tree<Accessor> (
-        // cannot use make_unique here; private constructor
-        unique_ptr<NodePrivate> (new NodePrivate (id, tag)),
+        std::move(nodePrivate),
         Context::create()
     );
 
@@ -185,12 +301,105 @@ Tree<Accessor> Engine::makeNodeWithId (
 }
 
 
+std::vector<Tree<Accessor>> Engine::openJournal (QString const & fileName) {
+    hopefully(_journal == nullptr, HERE);
+
+    // Clones made before the journal was opened can't be filled in later
+    // without the journal seeing inserts into nodes it never saw created.
+    materializeDeferredClones();
+
+    // Replay has to happen before the journal is installed, otherwise the
+    // mutations it performs would be appended to the log a second time.
+    auto journal = make_unique<Journal>(fileName, HERE);
+    auto roots = journal->replay(HERE);
+
+    std::unordered_set<NodePrivate const *> replayed;
+    for (auto & root : roots)
+        replayed.insert(root.get());
+
+    std::vector<Tree<Accessor>> result;
+    result.reserve(roots.size());
+    for (auto & root : roots) {
+        result.push_back(Tree<Accessor> (std::move(root), Context::create()));
+    }
+
+    // Nodes that existed before the journal did would otherwise be named
+    // by records that replay has never seen created.  A log that is mostly
+    // history gets rewritten instead; otherwise only those trees are added.
+    std::vector<NodePrivate const *> live = liveRoots();
+    if (journal->wantsCompaction(_nodePool.liveNodeCount()))
+        journal->compact(live, HERE);
+    else {
+        std::vector<NodePrivate const *> unseen;
+        for (NodePrivate const * root : live) {
+            if (replayed.count(root) == 0)
+                unseen.push_back(root);
+        }
+        journal->appendTrees(unseen);
+    }
+    _journal = std::move(journal);
+    return result;
+}
+
+
+void Engine::materializeDeferredClones () {
+    std::vector<NodePrivate *> deferred;
+    {
+        QMutexLocker lock (&_deferredLock);
+        for (auto & entry : _deferredClones)
+            deferred.push_back(entry.second);
+    }
+    for (NodePrivate * clone : deferred)
+        clone->materialize();
+}
+
+
+std::vector<NodePrivate const *> Engine::liveRoots () {
+    std::vector<NodePrivate const *> result;
+    quint32 const limit = _nodePool.slotLimit();
+    for (quint32 slot = 0; slot < limit; slot++) {
+        auto node = static_cast<NodePrivate const *>(
+            _nodePool.maybeSlotOwner(slot)
+        );
+        if (node and node->_parent == nullptr)
+            result.push_back(node);
+    }
+    return result;
+}
+
+
+void Engine::syncJournal () {
+    hopefully(_journal != nullptr, HERE);
+    _journal->sync();
+}
+
+
+void Engine::compactJournal () {
+    hopefully(_journal != nullptr, HERE);
+
+    materializeDeferredClones();
+
+    _journal->compact(liveRoots(), HERE);
+}
+
+
+void Engine::closeJournal () {
+    hopefully(_journal != nullptr, HERE);
+    _journal->sync();
+    _journal.reset();
+}
+
+
 Engine::~Engine () {
     // Have to clean up any engine objects (nodes, observers, etc.) that
     // we allocated ourself before shutting down...
     _dummyObserver.reset();
+    _internPool.clear();
+    _journal.reset();
 
-    int size = _mapIdToNode.size();
+    // The identity index no longer sees every node, so ask the pool how
+    // many nodes are still holding slots instead.
+    int size = static_cast<int>(_nodePool.liveNodeCount());
     hopefully(size == 0, QString::number(size) + "nodes leaked", HERE);
 
     hopefully(globalEngine == this, HERE);
@@ -0,0 +1,337 @@
+//
+// identitymap.cpp
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#include <thread>
+
+#include "methyl/identitymap.h"
+
+namespace methyl {
+
+namespace {
+
+// The two halves of the UUID, which are what the slots compare
+void splitIdentity (Identity const & id, quint64 & high, quint64 & low) {
+    QUuid const uuid = id.toUuid();
+    high = (static_cast<quint64>(uuid.data1) << 32)
+        | (static_cast<quint64>(uuid.data2) << 16)
+        | uuid.data3;
+
+    low = 0;
+    for (uchar byte : uuid.data4)
+        low = (low << 8) | byte;
+}
+
+} // end anonymous namespace
+
+
+IdentityMap::Table::Table (size_t capacity) :
+    _mask (capacity - 1),
+    _slots (new Slot[capacity])
+{
+    for (size_t index = 0; index < capacity; index++)
+        _slots[index]._node.store(nullptr, std::memory_order_relaxed);
+}
+
+
+IdentityMap::IdentityMap () {
+    for (Shard & shard : _shards) {
+        shard._sequence.store(0, std::memory_order_relaxed);
+        shard._count.store(0, std::memory_order_relaxed);
+        shard._tables.emplace_back(new Table (initialCapacity));
+        shard._table.store(
+            shard._tables.back().get(), std::memory_order_release
+        );
+    }
+}
+
+
+size_t IdentityMap::shardFor (size_t hash) {
+    // The low bits go to picking a slot inside the shard's own table, so
+    // take the shard from the high bits to keep the two independent.
+    return (hash >> (sizeof(size_t) * 8 - 6)) % shardCount;
+}
+
+
+NodePrivate * IdentityMap::probe (
+    Table const & table,
+    size_t hash,
+    quint64 high,
+    quint64 low
+) {
+    // A reader can see a table in the middle of a change, so it can't
+    // count on finding an empty slot; it gives up after a full lap.
+    size_t position = hash & table._mask;
+    for (size_t tries = 0; tries <= table._mask; tries++) {
+        Slot const & slot = table._slots[position];
+        NodePrivate * node = slot._node.load(std::memory_order_relaxed);
+        if (not node)
+            return nullptr;
+
+        if (
+            slot._hash.load(std::memory_order_relaxed) == hash
+            and slot._high.load(std::memory_order_relaxed) == high
+            and slot._low.load(std::memory_order_relaxed) == low
+        ) {
+            return node;
+        }
+        position = (position + 1) & table._mask;
+    }
+    return nullptr;
+}
+
+
+NodePrivate * IdentityMap::maybeFind (Identity const & id) const {
+    size_t const hash = std::hash<Identity>()(id);
+    quint64 high;
+    quint64 low;
+    splitIdentity(id, high, low);
+
+    Shard const & shard = _shards[shardFor(hash)];
+
+    while (true) {
+        quint32 const before = shard._sequence.load(std::memory_order_acquire);
+        if (before & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        NodePrivate * result = probe(
+            *shard._table.load(std::memory_order_acquire), hash, high, low
+        );
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (shard._sequence.load(std::memory_order_relaxed) == before)
+            return result;
+    }
+}
+
+
+IdentityMap::Slot * IdentityMap::maybeSlot (
+    Table const & table,
+    size_t hash,
+    quint64 high,
+    quint64 low
+) {
+    size_t position = hash & table._mask;
+    while (true) {
+        Slot & slot = table._slots[position];
+        if (not slot._node.load(std::memory_order_relaxed))
+            return nullptr;
+
+        if (
+            slot._hash.load(std::memory_order_relaxed) == hash
+            and slot._high.load(std::memory_order_relaxed) == high
+            and slot._low.load(std::memory_order_relaxed) == low
+        ) {
+            return &slot;
+        }
+        position = (position + 1) & table._mask;
+    }
+}
+
+
+void IdentityMap::place (
+    Table & table,
+    size_t hash,
+    quint64 high,
+    quint64 low,
+    NodePrivate * nodePrivate
+) {
+    size_t position = hash & table._mask;
+    while (table._slots[position]._node.load(std::memory_order_relaxed))
+        position = (position + 1) & table._mask;
+
+    Slot & slot = table._slots[position];
+    slot._hash.store(hash, std::memory_order_relaxed);
+    slot._high.store(high, std::memory_order_relaxed);
+    slot._low.store(low, std::memory_order_relaxed);
+    slot._node.store(nodePrivate, std::memory_order_relaxed);
+}
+
+
+void IdentityMap::remove (Table & table, Slot & slot) {
+    // Linear probing lets an entry be removed without leaving a marker, by
+    // moving back each later entry in the run whose home slot comes at or
+    // before the gap.
+    size_t gap = &slot - table._slots.get();
+    size_t position = gap;
+    while (true) {
+        position = (position + 1) & table._mask;
+        Slot & next = table._slots[position];
+        NodePrivate * node = next._node.load(std::memory_order_relaxed);
+        if (not node)
+            break;
+
+        size_t const hash = next._hash.load(std::memory_order_relaxed);
+        size_t const home = hash & table._mask;
+        size_t const fromHome = (position - home) & table._mask;
+        size_t const fromGap = (position - gap) & table._mask;
+        if (fromHome < fromGap)
+            continue;
+
+        Slot & hole = table._slots[gap];
+        hole._hash.store(hash, std::memory_order_relaxed);
+        hole._high.store(
+            next._high.load(std::memory_order_relaxed),
+            std::memory_order_relaxed
+        );
+        hole._low.store(
+            next._low.load(std::memory_order_relaxed),
+            std::memory_order_relaxed
+        );
+        hole._node.store(node, std::memory_order_relaxed);
+        gap = position;
+    }
+    table._slots[gap]._node.store(nullptr, std::memory_order_relaxed);
+}
+
+
+void IdentityMap::beginWrite (Shard & shard) {
+    // caller holds the shard's write lock
+    shard._sequence.store(
+        shard._sequence.load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed
+    );
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+
+void IdentityMap::endWrite (Shard & shard) {
+    shard._sequence.store(
+        shard._sequence.load(std::memory_order_relaxed) + 1,
+        std::memory_order_release
+    );
+}
+
+
+bool IdentityMap::insert (Identity const & id, NodePrivate * nodePrivate) {
+    size_t const hash = std::hash<Identity>()(id);
+    quint64 high;
+    quint64 low;
+    splitIdentity(id, high, low);
+
+    Shard & shard = _shards[shardFor(hash)];
+
+    QMutexLocker lock (&shard._writeLock);
+
+    Table * table = shard._table.load(std::memory_order_relaxed);
+    if (maybeSlot(*table, hash, high, low))
+        return false;
+
+    beginWrite(shard);
+
+    // Keep the table at most half full, so runs stay short
+    size_t const count = shard._count.load(std::memory_order_relaxed) + 1;
+    if (count * 2 > table->_mask + 1) {
+        shard._tables.emplace_back(new Table ((table->_mask + 1) * 2));
+        Table * bigger = shard._tables.back().get();
+        for (size_t index = 0; index <= table->_mask; index++) {
+            Slot const & slot = table->_slots[index];
+            NodePrivate * node = slot._node.load(std::memory_order_relaxed);
+            if (node) {
+                place(
+                    *bigger,
+                    slot._hash.load(std::memory_order_relaxed),
+                    slot._high.load(std::memory_order_relaxed),
+                    slot._low.load(std::memory_order_relaxed),
+                    node
+                );
+            }
+        }
+        shard._table.store(bigger, std::memory_order_release);
+        table = bigger;
+    }
+
+    place(*table, hash, high, low, nodePrivate);
+    shard._count.store(count, std::memory_order_relaxed);
+
+    endWrite(shard);
+    return true;
+}
+
+
+bool IdentityMap::erase (Identity const & id) {
+    size_t const hash = std::hash<Identity>()(id);
+    quint64 high;
+    quint64 low;
+    splitIdentity(id, high, low);
+
+    Shard & shard = _shards[shardFor(hash)];
+
+    QMutexLocker lock (&shard._writeLock);
+
+    Table * table = shard._table.load(std::memory_order_relaxed);
+    Slot * slot = maybeSlot(*table, hash, high, low);
+    if (not slot)
+        return false;
+
+    beginWrite(shard);
+    remove(*table, *slot);
+    shard._count.fetch_sub(1, std::memory_order_relaxed);
+    endWrite(shard);
+    return true;
+}
+
+
+size_t IdentityMap::eraseBulk (std::vector<Identity> const & ids) {
+    std::array<std::vector<Identity const *>, shardCount> byShard;
+    std::vector<size_t> hashes;
+    hashes.reserve(ids.size());
+    for (Identity const & id : ids) {
+        hashes.push_back(std::hash<Identity>()(id));
+        byShard[shardFor(hashes.back())].push_back(&id);
+    }
+
+    size_t erased = 0;
+    for (size_t index = 0; index < shardCount; index++) {
+        if (byShard[index].empty())
+            continue;
+
+        Shard & shard = _shards[index];
+        QMutexLocker lock (&shard._writeLock);
+        Table * table = shard._table.load(std::memory_order_relaxed);
+
+        beginWrite(shard);
+        for (Identity const * id : byShard[index]) {
+            quint64 high;
+            quint64 low;
+            splitIdentity(*id, high, low);
+            Slot * slot = maybeSlot(*table, hashes[id - ids.data()], high, low);
+            if (slot) {
+                remove(*table, *slot);
+                shard._count.fetch_sub(1, std::memory_order_relaxed);
+                erased++;
+            }
+        }
+        endWrite(shard);
+    }
+    return erased;
+}
+
+
+size_t IdentityMap::size () const {
+    size_t total = 0;
+    for (Shard const & shard : _shards)
+        total += shard._count.load(std::memory_order_relaxed);
+    return total;
+}
+
+} // end namespace methyl
@@ -0,0 +1,75 @@
+//
+// internpool.cpp
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#include "methyl/internpool.h"
+#include "methyl/nodeprivate.h"
+
+namespace methyl {
+
+InternPool::InternPool () {
+}
+
+
+NodePrivate const & InternPool::intern (unique_ptr<NodePrivate> tree) {
+    hopefully(tree and not tree->hasParent(), HERE);
+    tree->materialize();
+
+    // Hashing fills in the hash and size caches all the way down, which
+    // makes every later comparison against this tree cheap.
+    size_t const hash = tree->subtreeHash();
+
+    QMutexLocker lock (&_lock);
+
+    auto range = _trees.equal_range(hash);
+    for (auto iter = range.first; iter != range.second; ++iter) {
+        if (iter->second->isSubtreeCongruentTo(*tree))
+            return *iter->second; // unique_ptr frees the duplicate
+    }
+
+    NodePrivate * pooled = tree.release();
+    _trees.insert(std::make_pair(hash, pooled));
+    return *pooled;
+}
+
+
+size_t InternPool::size () const {
+    QMutexLocker lock (&_lock);
+    return _trees.size();
+}
+
+
+void InternPool::clear () {
+    std::unordered_multimap<size_t, NodePrivate *> trees;
+    {
+        QMutexLocker lock (&_lock);
+        trees.swap(_trees);
+    }
+
+    for (auto & entry : trees)
+        unique_ptr<NodePrivate> (entry.second).reset();
+}
+
+
+InternPool::~InternPool () {
+    clear();
+}
+
+} // end namespace methyl
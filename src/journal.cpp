@@ -0,0 +1,581 @@
+//
+// journal.cpp
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#include <QDataStream>
+#include <QSaveFile>
+#include <QtEndian>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "methyl/journal.h"
+#include "methyl/nodeprivate.h"
+
+namespace methyl {
+
+tracked<bool> globalDebugJournal (false, HERE);
+
+namespace {
+
+// Every record starts with a little-endian 32-bit length of the payload,
+// then a 16-bit checksum of the payload.  The payload itself is written
+// with QDataStream so that the strings and UUIDs have a portable format.
+int const recordHeaderSize = sizeof(quint32) + sizeof(quint16);
+
+QDataStream::Version const journalStreamVersion = QDataStream::Qt_5_0;
+
+// How many Engine::batch calls (or other groups) this thread is inside of
+thread_local int groupDepth = 0;
+
+} // end anonymous namespace
+
+
+Journal::Journal (QString const & fileName, codeplace const & cp) :
+    _file (fileName),
+    _replayed (false),
+    _recordCount (0)
+{
+    hopefully(_file.open(QIODevice::ReadWrite), _file.errorString(), cp);
+}
+
+
+Journal::~Journal () {
+    QMutexLocker lock (&_mutex);
+    writePending();
+    _file.close();
+}
+
+
+//
+// REPLAY
+//
+// The log is mapped rather than read, so a large journal does not have to
+// be copied into a buffer before the records can be walked.
+//
+
+std::vector<unique_ptr<NodePrivate>> Journal::replay (codeplace const & cp) {
+    hopefully(not _replayed, cp);
+    _replayed = true;
+
+    std::unordered_map<Identity, NodePrivate *> nodes;
+    std::unordered_map<Identity, unique_ptr<NodePrivate>> roots;
+
+    auto lookup = [&](QUuid const & uuid) -> NodePrivate & {
+        auto iter = nodes.find(Identity (uuid));
+        hopefully(iter != end(nodes), "Journal names unknown node", cp);
+        return *iter->second;
+    };
+
+    auto takeRoot = [&](QUuid const & uuid) -> unique_ptr<NodePrivate> {
+        auto iter = roots.find(Identity (uuid));
+        hopefully(iter != end(roots), "Journal inserts non-root node", cp);
+        unique_ptr<NodePrivate> result = std::move(iter->second);
+        roots.erase(iter);
+        return result;
+    };
+
+    qint64 const size = _file.size();
+    qint64 offset = 0;
+
+    if (size != 0) {
+        uchar * base = _file.map(0, size);
+        hopefully(base != nullptr, _file.errorString(), cp);
+
+        while (size - offset >= recordHeaderSize) {
+            uchar const * header = base + offset;
+            quint32 const length = qFromLittleEndian<quint32>(header);
+            quint16 const checksum = qFromLittleEndian<quint16>(
+                header + sizeof(quint32)
+            );
+
+            if (size - offset - recordHeaderSize < length)
+                break;
+
+            char const * data = reinterpret_cast<char const *>(
+                header + recordHeaderSize
+            );
+            if (qChecksum(data, length) != checksum)
+                break;
+
+            QDataStream in (QByteArray::fromRawData(data, length));
+            in.setVersion(journalStreamVersion);
+
+            quint8 opcode;
+            QUuid uuid;
+            in >> opcode >> uuid;
+
+            switch (static_cast<Opcode>(opcode)) {
+            case Opcode::CreateWithTag:
+            case Opcode::CreateAsText: {
+                // cannot use make_unique here; private constructor
+                unique_ptr<NodePrivate> node;
+                if (static_cast<Opcode>(opcode) == Opcode::CreateWithTag)
+                    node.reset(new NodePrivate (Identity (uuid), readTag(in)));
+                else {
+                    QString text;
+                    in >> text;
+                    node.reset(new NodePrivate (Identity (uuid), text));
+                }
+                // These ids were already out in the world before the crash
+                node->publishIdentity(cp);
+                nodes[Identity (uuid)] = node.get();
+                roots.insert(std::make_pair(Identity (uuid), std::move(node)));
+                break;
+            }
+
+            case Opcode::SetTag: {
+                lookup(uuid).setTag(readTag(in));
+                break;
+            }
+
+            case Opcode::SetText: {
+                QString text;
+                in >> text;
+                lookup(uuid).setText(text);
+                break;
+            }
+
+            case Opcode::InsertChildAsFirstInLabel:
+            case Opcode::InsertChildAsLastInLabel: {
+                QUuid childUuid;
+                in >> childUuid;
+                Label const label = readLabel(in);
+
+                NodePrivate & parent = lookup(uuid);
+                if (static_cast<Opcode>(opcode)
+                    == Opcode::InsertChildAsFirstInLabel
+                ) {
+                    parent.insertChildAsFirstInLabel(
+                        takeRoot(childUuid), label
+                    );
+                } else {
+                    parent.insertChildAsLastInLabel(
+                        takeRoot(childUuid), label
+                    );
+                }
+                break;
+            }
+
+            case Opcode::InsertSiblingAfter:
+            case Opcode::InsertSiblingBefore: {
+                QUuid siblingUuid;
+                in >> siblingUuid;
+
+                NodePrivate & sibling = lookup(uuid);
+                if (static_cast<Opcode>(opcode) == Opcode::InsertSiblingAfter)
+                    sibling.insertSiblingAfter(takeRoot(siblingUuid));
+                else
+                    sibling.insertSiblingBefore(takeRoot(siblingUuid));
+                break;
+            }
+
+            case Opcode::Detach: {
+                auto result = lookup(uuid).detach();
+                roots.insert(std::make_pair(
+                    Identity (uuid), std::move(std::get<0>(result))
+                ));
+                break;
+            }
+
+            case Opcode::ReplaceWith: {
+                QUuid replacementUuid;
+                in >> replacementUuid;
+
+                auto result = lookup(uuid).replaceWith(
+                    takeRoot(replacementUuid)
+                );
+                roots.insert(std::make_pair(
+                    Identity (uuid), std::move(std::get<0>(result))
+                ));
+                break;
+            }
+
+            case Opcode::Destroy: {
+                unique_ptr<NodePrivate> root = takeRoot(uuid);
+                NodePrivate const * current = root.get();
+                while (current) {
+                    nodes.erase(current->_id);
+                    current = current->maybeNextPreorderNodeUnderRoot(*root);
+                }
+                root.reset();
+                break;
+            }
+
+            default:
+                throw hopefullyNotReached("Unknown journal opcode", cp);
+            }
+
+            hopefully(in.status() == QDataStream::Ok, cp);
+            offset += recordHeaderSize + length;
+            _recordCount++;
+        }
+
+        _file.unmap(base);
+    }
+
+    // Anything past the last intact record is a partial append from a crash;
+    // chop it off so new records do not get written after garbage.
+    if (offset != size) {
+        chronicle(globalDebugJournal, [&](QDebug o) {
+            o << "Journal truncating" << (size - offset) << "torn bytes";
+        }, HERE);
+        hopefully(_file.resize(offset), _file.errorString(), cp);
+    }
+    hopefully(_file.seek(offset), _file.errorString(), cp);
+
+    std::vector<unique_ptr<NodePrivate>> result;
+    result.reserve(roots.size());
+    for (auto & root : roots) {
+        result.push_back(std::move(root.second));
+    }
+    return result;
+}
+
+
+//
+// RECORDING
+//
+
+void Journal::writeTag (QDataStream & out, Tag const & tag) {
+    if (tag.isUuid())
+        out << static_cast<quint8>(1) << tag._uuid;
+    else
+        out << static_cast<quint8>(0) << tag.urlString();
+}
+
+
+Tag Journal::readTag (QDataStream & in) {
+    quint8 isUuid;
+    in >> isUuid;
+    if (isUuid) {
+        QUuid uuid;
+        in >> uuid;
+        return Tag (uuid);
+    }
+
+    // The string was interned before, so it needs no checking again
+    QString urlString;
+    in >> urlString;
+    return Tag (AtomTable::instance().intern(urlString), Tag::FromAtom ());
+}
+
+
+void Journal::writeLabel (QDataStream & out, Label const & label) {
+    writeTag(out, static_cast<Tag const &>(label));
+}
+
+
+Label Journal::readLabel (QDataStream & in) {
+    return Label (readTag(in));
+}
+
+
+void Journal::frameRecord (QByteArray & buffer, QByteArray const & payload) {
+    uchar header[recordHeaderSize];
+    qToLittleEndian<quint32>(payload.size(), header);
+    qToLittleEndian<quint16>(
+        qChecksum(payload.constData(), payload.size()),
+        header + sizeof(quint32)
+    );
+
+    buffer.append(reinterpret_cast<char const *>(header), recordHeaderSize);
+    buffer.append(payload);
+}
+
+
+void Journal::append (QByteArray const & payload) {
+    QMutexLocker lock (&_mutex);
+
+    hopefully(_replayed, HERE);
+
+    frameRecord(_pending, payload);
+    _recordCount++;
+
+    // Every thread's records share the one buffer, which keeps them in the
+    // order they happened.  Whoever ends a group writes them all out.
+    if (groupDepth == 0 or _pending.size() >= pendingLimit)
+        writePending();
+}
+
+
+void Journal::writePending () {
+    // caller holds the mutex
+    if (_pending.isEmpty())
+        return;
+
+    // A short write is caught by the checksum on replay, and not here
+    _file.write(_pending);
+    _file.flush();
+    _pending.clear();
+}
+
+
+void Journal::beginGroup () {
+    groupDepth++;
+}
+
+
+void Journal::endGroup (Journal * journal) {
+    groupDepth--;
+    if (groupDepth == 0 and journal) {
+        QMutexLocker lock (&journal->_mutex);
+        journal->writePending();
+    }
+}
+
+
+QByteArray Journal::createPayload (NodePrivate const & node) {
+    QByteArray payload;
+    QDataStream out (&payload, QIODevice::WriteOnly);
+    out.setVersion(journalStreamVersion);
+
+    if (node.hasTag()) {
+        out << static_cast<quint8>(Opcode::CreateWithTag)
+            << node._id.toUuid();
+        writeTag(out, node.tag(HERE));
+    } else {
+        out << static_cast<quint8>(Opcode::CreateAsText)
+            << node._id.toUuid()
+            << node.text(HERE);
+    }
+    return payload;
+}
+
+
+QByteArray Journal::insertChildPayload (
+    Opcode opcode,
+    NodePrivate const & parent,
+    NodePrivate const & newChild,
+    Label const & label
+) {
+    QByteArray payload;
+    QDataStream out (&payload, QIODevice::WriteOnly);
+    out.setVersion(journalStreamVersion);
+
+    out << static_cast<quint8>(opcode)
+        << parent._id.toUuid()
+        << newChild._id.toUuid();
+    writeLabel(out, label);
+    return payload;
+}
+
+
+void Journal::recordCreate (NodePrivate const & node) {
+    append(createPayload(node));
+}
+
+
+void Journal::recordSetTag (NodePrivate const & node, Tag const & tag) {
+    QByteArray payload;
+    QDataStream out (&payload, QIODevice::WriteOnly);
+    out.setVersion(journalStreamVersion);
+
+    out << static_cast<quint8>(Opcode::SetTag)
+        << node._id.toUuid();
+    writeTag(out, tag);
+    append(payload);
+}
+
+
+void Journal::recordSetText (NodePrivate const & node, QString const & text) {
+    QByteArray payload;
+    QDataStream out (&payload, QIODevice::WriteOnly);
+    out.setVersion(journalStreamVersion);
+
+    out << static_cast<quint8>(Opcode::SetText)
+        << node._id.toUuid()
+        << text;
+    append(payload);
+}
+
+
+void Journal::recordInsertChild (
+    Opcode opcode,
+    NodePrivate const & parent,
+    NodePrivate const & newChild,
+    Label const & label
+) {
+    append(insertChildPayload(opcode, parent, newChild, label));
+}
+
+
+void Journal::recordInsertSibling (
+    Opcode opcode,
+    NodePrivate const & sibling,
+    NodePrivate const & newSibling
+) {
+    QByteArray payload;
+    QDataStream out (&payload, QIODevice::WriteOnly);
+    out.setVersion(journalStreamVersion);
+
+    out << static_cast<quint8>(opcode)
+        << sibling._id.toUuid()
+        << newSibling._id.toUuid();
+    append(payload);
+}
+
+
+void Journal::recordDetach (NodePrivate const & node) {
+    QByteArray payload;
+    QDataStream out (&payload, QIODevice::WriteOnly);
+    out.setVersion(journalStreamVersion);
+
+    out << static_cast<quint8>(Opcode::Detach)
+        << node._id.toUuid();
+    append(payload);
+}
+
+
+void Journal::recordReplaceWith (
+    NodePrivate const & node,
+    NodePrivate const & replacement
+) {
+    QByteArray payload;
+    QDataStream out (&payload, QIODevice::WriteOnly);
+    out.setVersion(journalStreamVersion);
+
+    out << static_cast<quint8>(Opcode::ReplaceWith)
+        << node._id.toUuid()
+        << replacement._id.toUuid();
+    append(payload);
+}
+
+
+void Journal::recordDestroy (NodePrivate const & node) {
+    QByteArray payload;
+    QDataStream out (&payload, QIODevice::WriteOnly);
+    out.setVersion(journalStreamVersion);
+
+    out << static_cast<quint8>(Opcode::Destroy)
+        << node._id.toUuid();
+    append(payload);
+}
+
+
+//
+// SNAPSHOTS AND COMPACTION
+//
+// Preorder with insert-as-last rebuilds each tree exactly, because labels
+// are kept sorted and children come out of the walk in their label order.
+//
+
+size_t Journal::frameTree (QByteArray & buffer, NodePrivate const & root) {
+    size_t count = 0;
+    NodePrivate const * current = &root;
+    while (current) {
+        frameRecord(buffer, createPayload(*current));
+        if (current != &root) {
+            frameRecord(buffer, insertChildPayload(
+                Opcode::InsertChildAsLastInLabel,
+                *current->_parent,
+                *current,
+                *current->_labelInParent
+            ));
+        }
+        count++;
+        current = current->maybeNextPreorderNodeUnderRoot(root);
+    }
+    return count;
+}
+
+
+void Journal::appendTrees (std::vector<NodePrivate const *> const & roots) {
+    QMutexLocker lock (&_mutex);
+
+    hopefully(_replayed, HERE);
+
+    for (NodePrivate const * root : roots) {
+        size_t const nodes = frameTree(_pending, *root);
+        _recordCount += 2 * nodes - 1;
+        if (_pending.size() >= pendingLimit)
+            writePending();
+    }
+    writePending();
+}
+
+
+bool Journal::wantsCompaction (size_t liveNodes) const {
+    // A snapshot is a create and an insert for each node but the roots
+    qint64 const snapshotRecords = 2 * static_cast<qint64>(liveNodes);
+    return _recordCount > compactionMinimum
+        and _recordCount > compactionRatio * snapshotRecords;
+}
+
+
+void Journal::compact (
+    std::vector<NodePrivate const *> const & roots,
+    codeplace const & cp
+) {
+    QMutexLocker lock (&_mutex);
+
+    hopefully(_replayed, cp);
+
+    QSaveFile snapshot (_file.fileName());
+    hopefully(
+        snapshot.open(QIODevice::WriteOnly), snapshot.errorString(), cp
+    );
+
+    // Whatever was buffered is part of the state being snapshotted
+    _pending.clear();
+    _recordCount = 0;
+
+    size_t count = 0;
+    QByteArray buffer;
+    for (NodePrivate const * root : roots) {
+        size_t const nodes = frameTree(buffer, *root);
+        count += nodes;
+        _recordCount += 2 * nodes - 1;
+        if (buffer.size() >= pendingLimit) {
+            snapshot.write(buffer);
+            buffer.clear();
+        }
+    }
+    snapshot.write(buffer);
+
+    // The old file handle still points at the log that is being replaced,
+    // so it has to be closed and reopened on the snapshot afterward.
+    _file.close();
+    hopefully(snapshot.commit(), snapshot.errorString(), cp);
+    hopefully(_file.open(QIODevice::ReadWrite), _file.errorString(), cp);
+    hopefully(_file.seek(_file.size()), _file.errorString(), cp);
+
+    chronicle(globalDebugJournal, [&](QDebug o) {
+        o << "Journal compacted to" << count << "nodes in"
+            << roots.size() << "trees";
+    }, HERE);
+}
+
+
+void Journal::sync () {
+    QMutexLocker lock (&_mutex);
+
+    writePending();
+#ifdef Q_OS_WIN
+    hopefully(_commit(_file.handle()) == 0, HERE);
+#else
+    hopefully(fsync(_file.handle()) == 0, HERE);
+#endif
+}
+
+} // end namespace methyl
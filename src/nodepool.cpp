@@ -0,0 +1,351 @@
+//
+// nodepool.cpp
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#include <algorithm>
+#include <atomic>
+
+#include "methyl/nodepool.h"
+#include "methyl/engine.h"
+
+namespace methyl {
+
+namespace {
+
+std::atomic<quint64> nextPoolSerial (1);
+
+// Big enough that a thread building a tree rarely touches the class lock,
+// small enough that blocks parked in idle threads don't add up to much.
+size_t const cacheDepth = 64;
+
+} // end anonymous namespace
+
+
+struct NodePool::ThreadCache {
+    NodePool * _pool = nullptr;
+    quint64 _serial = 0;
+
+    std::array<std::array<void *, cacheDepth>, 12> _blocks;
+    std::array<size_t, 12> _counts {};
+
+    // Only this thread touches the vector; the count is for liveNodeCount
+    std::vector<quint32> _slots;
+    std::atomic<size_t> _slotCount {0};
+
+    ~ThreadCache () {
+        // Blocks go back only if the pool they came from is still the one
+        // in effect; otherwise its slabs (and these blocks) are already gone.
+        if (
+            not _pool or not globalEngine
+            or &globalEngine->_nodePool != _pool or _pool->_serial != _serial
+        ) {
+            return;
+        }
+        for (int index = 0; index < static_cast<int>(_counts.size()); index++)
+            _pool->drain(index, *this, _counts[index]);
+
+        _pool->drainSlots(*this, _slots.size());
+
+        QMutexLocker lock (&_pool->_slotsMutex);
+        auto & caches = _pool->_caches;
+        caches.erase(std::find(caches.begin(), caches.end(), this));
+    }
+};
+
+
+NodePool::NodePool () :
+    _serial (nextPoolSerial.fetch_add(1)),
+    _nextSlot (0),
+    _slotPages (new std::atomic<std::atomic<void *> *>[maxSlotPages])
+{
+    for (size_t page = 0; page < maxSlotPages; page++)
+        _slotPages[page].store(nullptr, std::memory_order_relaxed);
+}
+
+
+NodePool & NodePool::current () {
+    return globalEngine->_nodePool;
+}
+
+
+int NodePool::classForSize (size_t size) {
+    auto const sizes = classSizes();
+    for (int index = 0; index < static_cast<int>(sizes.size()); index++) {
+        if (size <= sizes[index])
+            return index;
+    }
+    return -1;
+}
+
+
+char * NodePool::newSlab () {
+    char * slab = static_cast<char *>(::operator new (slabSize));
+
+    QMutexLocker lock (&_slabsMutex);
+    _slabs.push_back(slab);
+    return slab;
+}
+
+
+NodePool::ThreadCache & NodePool::cacheForThisThread () {
+    static thread_local ThreadCache cache;
+
+    if (cache._serial == _serial)
+        return cache;
+
+    // Whatever the thread had cached belonged to a pool that's gone
+    cache._pool = this;
+    cache._serial = _serial;
+    cache._counts.fill(0);
+    cache._slots.clear();
+    cache._slotCount.store(0, std::memory_order_relaxed);
+
+    QMutexLocker lock (&_slotsMutex);
+    _caches.push_back(&cache);
+    return cache;
+}
+
+
+void NodePool::refill (int index, ThreadCache & cache) {
+    size_t const blockSize = classSizes()[index];
+    SizeClass & sizeClass = _classes[index];
+    auto & blocks = cache._blocks[index];
+    size_t & count = cache._counts[index];
+
+    QMutexLocker lock (&sizeClass._mutex);
+
+    while (count < cacheDepth / 2) {
+        if (sizeClass._free) {
+            FreeBlock * block = sizeClass._free;
+            sizeClass._free = block->_next;
+            blocks[count++] = block;
+            continue;
+        }
+
+        if (sizeClass._bumpEnd - sizeClass._bump < static_cast<ptrdiff_t>(blockSize)) {
+            // Whatever is left at the end of the old slab is too small to be
+            // a block in this class, so it is just abandoned.
+            sizeClass._bump = newSlab();
+            sizeClass._bumpEnd = sizeClass._bump + slabSize;
+        }
+
+        blocks[count++] = sizeClass._bump;
+        sizeClass._bump += blockSize;
+    }
+}
+
+
+void NodePool::drain (int index, ThreadCache & cache, size_t count) {
+    SizeClass & sizeClass = _classes[index];
+    auto & blocks = cache._blocks[index];
+    size_t & cached = cache._counts[index];
+
+    QMutexLocker lock (&sizeClass._mutex);
+
+    for (; count != 0; count--) {
+        FreeBlock * block = static_cast<FreeBlock *>(blocks[--cached]);
+        block->_next = sizeClass._free;
+        sizeClass._free = block;
+    }
+}
+
+
+void * NodePool::allocate (size_t size) {
+    int const index = classForSize(size);
+    if (index == -1)
+        return ::operator new (size);
+
+    ThreadCache & cache = cacheForThisThread();
+    if (cache._counts[index] == 0)
+        refill(index, cache);
+
+    return cache._blocks[index][--cache._counts[index]];
+}
+
+
+void NodePool::deallocate (void * pointer, size_t size) {
+    if (not pointer)
+        return;
+
+    int const index = classForSize(size);
+    if (index == -1) {
+        ::operator delete (pointer);
+        return;
+    }
+
+    ThreadCache & cache = cacheForThisThread();
+    if (cache._counts[index] == cacheDepth)
+        drain(index, cache, cacheDepth / 2);
+
+    cache._blocks[index][cache._counts[index]++] = pointer;
+}
+
+
+void NodePool::deallocateBulk (
+    std::vector<void *> const & pointers,
+    size_t size
+) {
+    int const index = classForSize(size);
+    if (index == -1) {
+        for (void * pointer : pointers)
+            ::operator delete (pointer);
+        return;
+    }
+
+    // Top up this thread's stack, and put the rest of a big subtree
+    // straight onto the shared free list under one lock.
+    ThreadCache & cache = cacheForThisThread();
+    auto & blocks = cache._blocks[index];
+    size_t & count = cache._counts[index];
+
+    auto iter = pointers.begin();
+    while (iter != pointers.end() and count < cacheDepth)
+        blocks[count++] = *iter++;
+
+    if (iter == pointers.end())
+        return;
+
+    SizeClass & sizeClass = _classes[index];
+
+    QMutexLocker lock (&sizeClass._mutex);
+
+    for (; iter != pointers.end(); ++iter) {
+        FreeBlock * block = static_cast<FreeBlock *>(*iter);
+        block->_next = sizeClass._free;
+        sizeClass._free = block;
+    }
+}
+
+
+size_t NodePool::liveNodeCount () {
+    // Every NodePrivate holds exactly one slot for as long as it lives, so
+    // it's whatever has been handed out less what is free, here or parked
+    // in some thread.
+    QMutexLocker lock (&_slotsMutex);
+
+    size_t result = _nextSlot - _freeSlots.size();
+    for (ThreadCache * cache : _caches)
+        result -= cache->_slotCount.load(std::memory_order_relaxed);
+    return result;
+}
+
+
+void NodePool::refillSlots (ThreadCache & cache) {
+    QMutexLocker lock (&_slotsMutex);
+
+    // Reuse the most recently freed slots; they're likely still warm in
+    // whatever side tables are indexed by them.
+    size_t const reused = std::min(_freeSlots.size(), slotBlockSize);
+    if (reused != 0) {
+        cache._slots.insert(
+            cache._slots.end(), _freeSlots.end() - reused, _freeSlots.end()
+        );
+        _freeSlots.resize(_freeSlots.size() - reused);
+    } else {
+        // Blocks never straddle a page, since the page size is a multiple
+        // of the block size
+        size_t const page = _nextSlot / slotPageSize;
+        hopefully(page < maxSlotPages, "Out of node slots", HERE);
+
+        if (not _slotPages[page].load(std::memory_order_relaxed)) {
+            auto owners = new std::atomic<void *>[slotPageSize];
+            for (size_t index = 0; index < slotPageSize; index++)
+                owners[index].store(nullptr, std::memory_order_relaxed);
+            _slotPages[page].store(owners, std::memory_order_release);
+        }
+
+        // Pushed in reverse so the lowest slot is popped first
+        for (size_t index = slotBlockSize; index != 0; index--)
+            cache._slots.push_back(_nextSlot + index - 1);
+        _nextSlot += slotBlockSize;
+    }
+    cache._slotCount.store(cache._slots.size(), std::memory_order_relaxed);
+}
+
+
+void NodePool::drainSlots (ThreadCache & cache, size_t count) {
+    QMutexLocker lock (&_slotsMutex);
+
+    _freeSlots.insert(
+        _freeSlots.end(), cache._slots.end() - count, cache._slots.end()
+    );
+    cache._slots.resize(cache._slots.size() - count);
+    cache._slotCount.store(cache._slots.size(), std::memory_order_relaxed);
+}
+
+
+quint32 NodePool::acquireSlot (void * owner) {
+    ThreadCache & cache = cacheForThisThread();
+    if (cache._slots.empty())
+        refillSlots(cache);
+
+    quint32 const slot = cache._slots.back();
+    cache._slots.pop_back();
+    cache._slotCount.store(cache._slots.size(), std::memory_order_relaxed);
+
+    _slotPages[slot / slotPageSize].load(std::memory_order_acquire)
+        [slot % slotPageSize].store(owner, std::memory_order_release);
+    return slot;
+}
+
+
+void NodePool::releaseSlots (std::vector<quint32> const & slots) {
+    for (quint32 slot : slots) {
+        _slotPages[slot / slotPageSize].load(std::memory_order_acquire)
+            [slot % slotPageSize].store(nullptr, std::memory_order_release);
+    }
+
+    ThreadCache & cache = cacheForThisThread();
+    cache._slots.insert(cache._slots.end(), slots.begin(), slots.end());
+    cache._slotCount.store(cache._slots.size(), std::memory_order_relaxed);
+
+    // Freeing a big subtree shouldn't leave all of its slots in one thread
+    if (cache._slots.size() > 2 * slotBlockSize)
+        drainSlots(cache, cache._slots.size() - slotBlockSize);
+}
+
+
+void * NodePool::maybeSlotOwner (quint32 slot) {
+    if (slot / slotPageSize >= maxSlotPages)
+        return nullptr;
+
+    std::atomic<void *> const * owners
+        = _slotPages[slot / slotPageSize].load(std::memory_order_acquire);
+    if (not owners)
+        return nullptr;
+    return owners[slot % slotPageSize].load(std::memory_order_acquire);
+}
+
+
+quint32 NodePool::slotLimit () {
+    QMutexLocker lock (&_slotsMutex);
+    return _nextSlot;
+}
+
+
+NodePool::~NodePool () {
+    for (char * slab : _slabs)
+        ::operator delete (slab);
+
+    for (size_t page = 0; page < maxSlotPages; page++)
+        delete [] _slotPages[page].load(std::memory_order_relaxed);
+}
+
+} // end namespace methyl
@@ -20,10 +20,14 @@
 //
 
 #include "methyl/nodeprivate.h"
+#include "methyl/journal.h"
 #include "methyl/engine.h"
 
 namespace methyl {
 
+using std::begin;
+using std::end;
+
 tracked<bool> globalDebugAccessor(false, HERE);
 tracked<bool> globalDebugNodeCreate (false, HERE);
 tracked<bool> globalDebugNodeLabeling (false, HERE);
@@ -33,70 +37,220 @@ tracked<bool> globalDebugNodeLabeling (false, HERE);
 //
 
 NodePrivate const * NodePrivate::maybeGetFromId (methyl::Identity const & id) {
-    QReadLocker lock (&globalEngine->_mapLock);
-
-    auto iter = globalEngine->_mapIdToNode.find(id);
-    if (iter == end(globalEngine->_mapIdToNode))
-        return nullptr;
-    return iter->second;
+    // A node that has never had its identity asked for can't be found
+    // here, but nobody could have gotten its id to ask with either.
+    return globalEngine->_mapIdToNode.maybeFind(id);
 }
 
 
 unique_ptr<NodePrivate> NodePrivate::createWithTag (Tag const & tag) {
     return unique_ptr<NodePrivate> (
-        new NodePrivate(Identity (QUuid::createUuid()), tag)
+        new NodePrivate(globalEngine->newIdentity(), tag)
     );
 }
 
 
 unique_ptr<NodePrivate> NodePrivate::createAsText (QString const & data) {
     return unique_ptr<NodePrivate> (
-        new NodePrivate(Identity (QUuid::createUuid()), data)
+        new NodePrivate(globalEngine->newIdentity(), data)
     );
 }
 
 
 unique_ptr<NodePrivate> NodePrivate::makeCloneOfSubtree () const {
+    // A pending clone has no children of its own to copy yet
+    materialize();
+
     NodePrivate const & original = *this;
 
     if (not original.hasTag())
         return NodePrivate::createAsText(original.text(HERE));
 
     auto clone = NodePrivate::createWithTag(original.tag(HERE));
-    if (not original.hasAnyLabels())
-        return clone;
-
-    Label label = original.firstLabel(HERE);
-    bool moreLabels = true;
-    unsigned int labelCount = 0;
-    while (moreLabels) {
-        const NodePrivate * childOfOriginal =
-            &original.firstChildInLabel(label, HERE);
-
-        labelCount++;
-        bool moreChildren = true;
-        unsigned int childCount = 0;
-        while (moreChildren) {
-            childCount++;
-            NodePrivate const * previousChildInLabel;
-            static_cast<void>(
-                clone->insertChildAsLastInLabel(
-                    childOfOriginal->makeCloneOfSubtree(), label
-                )
-            );
-            moreChildren = childOfOriginal->hasNextSiblingInLabel();
-            if (moreChildren)
-                childOfOriginal = &childOfOriginal->nextSiblingInLabel(HERE);
-        }
-        moreLabels = original.hasLabelAfter(label, HERE);
-        if (moreLabels)
-            label = original.labelAfter(label, HERE);
-    }
+    clone->cloneChildrenFrom(original);
+
+#ifndef QT_NO_DEBUG
+    // Checking the copy costs as much as making it, so only debug builds
+    // pay for that.
     hopefully(clone->isSubtreeCongruentTo(original), HERE);
+#endif
+    return clone;
+}
+
+
+void NodePrivate::cloneChildrenFrom (NodePrivate const & original) {
+    hopefully(hasTag() and _labelToChildren.empty(), HERE);
+
+    // A deferred clone may have been hashed while it was still empty
+    invalidateSubtreeHash();
+
+    Journal * journal = maybeJournal();
+
+    // Work through the tree a node at a time with an explicit worklist of
+    // (original, clone) pairs, so a deep tree can't blow the stack.  Each
+    // node's label table is copied over in one pass, and its children are
+    // linked in directly instead of going through insertChildAsLastInLabel
+    // and finding the label again for every child.
+    std::vector<std::pair<NodePrivate const *, NodePrivate *>> work;
+    work.emplace_back(&original, this);
+
+    while (not work.empty()) {
+        NodePrivate const * source = work.back().first;
+        NodePrivate * dest = work.back().second;
+        work.pop_back();
+
+        NodePrivate * previousClone = nullptr;
+
+        dest->_labelToChildren.assignFrom(source->_labelToChildren,
+            [&](child_range const & range) -> child_range {
+                child_range result {nullptr, nullptr};
+
+                NodePrivate const * child = range._first;
+                while (true) {
+                    unique_ptr<NodePrivate> childClone (
+                        child->hasTag()
+                            ? new NodePrivate (
+                                globalEngine->newIdentity(), *child->_tag
+                            )
+                            : new NodePrivate (
+                                globalEngine->newIdentity(), *child->_text
+                            )
+                    );
+
+                    childClone->linkIntoParent(
+                        *dest,
+                        *child->_labelInParent,
+                        previousClone,
+                        nullptr
+                    );
+                    previousClone = childClone.release();
+
+                    if (journal) {
+                        journal->recordInsertChild(
+                            Journal::Opcode::InsertChildAsLastInLabel,
+                            *dest,
+                            *previousClone,
+                            *previousClone->_labelInParent
+                        );
+                    }
+
+                    if (not result._first)
+                        result._first = previousClone;
+                    result._last = previousClone;
+
+                    if (child->hasTag() and not child->_labelToChildren.empty())
+                        work.emplace_back(child, previousClone);
+
+                    if (child == range._last)
+                        break;
+                    child = child->_nextSibling;
+                }
+                return result;
+            }
+        );
+    }
+}
+
+
+unique_ptr<NodePrivate> NodePrivate::makeDeferredCloneOfSubtree () const {
+    // The journal has no way to express "a copy of that, to be filled in
+    // later", so when journaling every clone is made up front.
+    if (not hasTag() or maybeJournal())
+        return makeCloneOfSubtree();
+
+    // A node that is itself still pending has no children, but is not empty
+    if (
+        _labelToChildren.empty()
+        and not _deferredSource.load(std::memory_order_acquire)
+    ) {
+        return makeCloneOfSubtree();
+    }
+
+    // cannot use make_unique here; private constructor
+    unique_ptr<NodePrivate> clone (
+        new NodePrivate (globalEngine->newIdentity(), *_tag)
+    );
+
+    QMutexLocker lock (&globalEngine->_deferredLock);
+
+    // A clone of a clone that hasn't been filled in yet can just wait on
+    // the same source.  That has to be decided under the lock, or this one
+    // could get filled in (and stop naming its source) in the meantime.
+    NodePrivate const * source = _deferredSource.load(std::memory_order_acquire);
+    if (not source)
+        source = this;
+
+    clone->_deferredSource.store(source, std::memory_order_release);
+    source->_hasDeferredClones.store(true, std::memory_order_release);
+    globalEngine->_deferredClones.insert(std::make_pair(source, clone.get()));
+    globalEngine->_deferredCount++;
+
     return clone;
 }
 
 
+void NodePrivate::materialize () const {
+    if (not _deferredSource.load(std::memory_order_acquire))
+        return;
+
+    QMutexLocker lock (&globalEngine->_deferredLock);
+
+    // Someone else may have gotten here first
+    NodePrivate const * source = _deferredSource.load(std::memory_order_acquire);
+    if (not source)
+        return;
+
+    forgetDeferredClone(*source);
+
+    const_cast<NodePrivate *>(this)->cloneChildrenFrom(*source);
+    _deferredSource.store(nullptr, std::memory_order_release);
+}
+
+
+void NodePrivate::forgetDeferredClone (NodePrivate const & source) const {
+    // caller must hold the engine's _deferredLock
+    auto range = globalEngine->_deferredClones.equal_range(&source);
+    for (auto iter = range.first; iter != range.second; ++iter) {
+        if (iter->second == this) {
+            globalEngine->_deferredClones.erase(iter);
+            globalEngine->_deferredCount--;
+            if (globalEngine->_deferredClones.count(&source) == 0)
+                source._hasDeferredClones.store(false, std::memory_order_release);
+            return;
+        }
+    }
+    throw hopefullyNotReached(HERE);
+}
+
+
+void NodePrivate::materializeClonesOf (NodePrivate const & source) {
+    std::vector<NodePrivate *> clones;
+    {
+        QMutexLocker lock (&globalEngine->_deferredLock);
+        auto range = globalEngine->_deferredClones.equal_range(&source);
+        for (auto iter = range.first; iter != range.second; ++iter)
+            clones.push_back(iter->second);
+    }
+
+    for (NodePrivate * clone : clones)
+        clone->materialize();
+}
+
+
+void NodePrivate::materializeDependents () const {
+    if (globalEngine->_deferredCount.load(std::memory_order_acquire) == 0)
+        return;
+
+    // A clone's source may be anywhere above the node being changed.  The
+    // per-node flag means only actual sources take the lock.
+    NodePrivate const * current = this;
+    while (current) {
+        if (current->_hasDeferredClones.load(std::memory_order_acquire))
+            materializeClonesOf(*current);
+        current = current->_parent;
+    }
+}
+
 
 //
 // Constructor and Destructor
@@ -110,21 +264,27 @@ unique_ptr<NodePrivate> NodePrivate::makeCloneOfSubtree () const {
 
 NodePrivate::NodePrivate (methyl::Identity const & id, QString const & text) :
     _parent (nullptr),
+    _previousSibling (nullptr),
+    _nextSibling (nullptr),
+    _labelInParent (),
     _id (id),
+    _slot (NodePool::current().acquireSlot(this)),
+    _published (false),
+    _deferredSource (nullptr),
+    _hasDeferredClones (false),
+    _cachedRoot (0),
+    _rootEpoch (globalEngine->newRootEpoch()),
+    _subtreeHash (0),
+    _subtreeSize (0),
     _tag (),
     _labelToChildren (),
     _text (text)
 {
+    if (not globalEngine->_lazyIdentityIndex)
+        publishIdentity(HERE);
 
-    {
-        QWriteLocker lock (&globalEngine->_mapLock);
-
-        bool wasInserted;
-        std::tie(std::ignore, wasInserted)
-            = globalEngine->_mapIdToNode.insert(std::make_pair(id, this));
-
-        hopefully(wasInserted, HERE);
-    }
+    if (Journal * journal = maybeJournal())
+        journal->recordCreate(*this);
 
     chronicle(globalDebugNodeCreate, [&](QDebug o) {
         o << "NodePrivate::Node() with methyl::Identity "
@@ -138,21 +298,28 @@ NodePrivate::NodePrivate (methyl::Identity const & id, QString const & text) :
 
 NodePrivate::NodePrivate (methyl::Identity const & id, Tag const & tag) :
     _parent (nullptr),
+    _previousSibling (nullptr),
+    _nextSibling (nullptr),
+    _labelInParent (),
     _id (id),
+    _slot (NodePool::current().acquireSlot(this)),
+    _published (false),
+    _deferredSource (nullptr),
+    _hasDeferredClones (false),
+    _cachedRoot (0),
+    _rootEpoch (globalEngine->newRootEpoch()),
+    _subtreeHash (0),
+    _subtreeSize (0),
     _tag (tag),
     _labelToChildren (),
     _text ()
 
 {
-    {
-        QWriteLocker lock (&globalEngine->_mapLock);
-
-        bool wasInserted;
-        std::tie(std::ignore, wasInserted)
-            = globalEngine->_mapIdToNode.insert(std::make_pair(id, this));
+    if (not globalEngine->_lazyIdentityIndex)
+        publishIdentity(HERE);
 
-        hopefully(wasInserted, HERE);
-    }
+    if (Journal * journal = maybeJournal())
+        journal->recordCreate(*this);
 
     chronicle(globalDebugNodeCreate, [&](QDebug o) {
         o << "NodePrivate::Node() with methyl::Identity"
@@ -166,35 +333,113 @@ NodePrivate::NodePrivate (methyl::Identity const & id, Tag const & tag) :
 
 NodePrivate::~NodePrivate ()
 {
-    // null out members to help prevent accesses from children during
-    // the destruction process.
-    _tag = nullopt;
-    _text = nullopt;
-    auto labelToChildren = std::move(_labelToChildren);
-
-    for (auto & labelChildren : labelToChildren) {
-        for (auto & child : labelChildren.second) {
-            child->_parent = nullptr;
-            delete child;
+    // Children have already been destructed by destroySubtree; all that is
+    // left is to let go of this node's own members.
+}
+
+
+void * NodePrivate::operator new (size_t size) {
+    return NodePool::current().allocate(size);
+}
+
+
+void NodePrivate::operator delete (void * pointer) {
+    NodePool::current().deallocate(pointer, sizeof(NodePrivate));
+}
+
+
+void NodePrivate::destroySubtree (NodePrivate * nodePrivate) {
+    // Only the top of a freed subtree is journaled; replaying its destroy
+    // takes the descendants along with it.
+    if (not nodePrivate->_parent) {
+        if (Journal * journal = maybeJournal())
+            journal->recordDestroy(*nodePrivate);
+    }
+
+    // Gather the subtree breadth-first with an explicit worklist, so a very
+    // deep tree cannot overflow the stack the way recursive deletes could.
+    std::vector<NodePrivate *> nodes {nodePrivate};
+    for (size_t index = 0; index < nodes.size(); index++) {
+        NodePrivate * child = nodes[index]->maybeFirstChild();
+        while (child) {
+            nodes.push_back(child);
+            child = child->_nextSibling;
         }
     }
 
-    // Currently the internal code for translating between Qt DOM elements
-    // and nodes needs to have the entry in _mapIdToAccessorto work; so the
-    // above tree traversal would not work if we removed the ID from the
-    // table first.
-    {
-        QWriteLocker lock (&globalEngine->_mapLock);
-        hopefully(globalEngine->_mapIdToNode.erase(identity()) == 1, HERE);
+    // Anything still waiting to copy from these nodes has to do it now, and
+    // if this is itself a clone that was never filled in, it stops waiting.
+    if (globalEngine->_deferredCount.load(std::memory_order_acquire) != 0) {
+        for (NodePrivate * node : nodes) {
+            if (node->_hasDeferredClones.load(std::memory_order_acquire))
+                materializeClonesOf(*node);
+        }
+
+        if (NodePrivate const * source = nodePrivate->_deferredSource.load()) {
+            QMutexLocker lock (&globalEngine->_deferredLock);
+            nodePrivate->forgetDeferredClone(*source);
+        }
+    }
+
+    std::vector<Identity> ids;
+    for (NodePrivate * node : nodes) {
+        if (node->_published.load(std::memory_order_acquire))
+            ids.push_back(node->_id);
     }
+    hopefully(globalEngine->_mapIdToNode.eraseBulk(ids) == ids.size(), HERE);
+    Observer::identitiesChanged(ids);
+
+    std::vector<void *> memory;
+    std::vector<quint32> slots;
+    memory.reserve(nodes.size());
+    slots.reserve(nodes.size());
+    for (NodePrivate * node : nodes) {
+        slots.push_back(node->_slot);
+        node->~NodePrivate();
+        memory.push_back(node);
+    }
+
+    Observer::forgetSlots(slots);
+    NodePool::current().releaseSlots(slots);
+
+    NodePool::current().deallocateBulk(memory, sizeof(NodePrivate));
 }
 
 
 methyl::Identity NodePrivate::identity() const {
+    // Once an identity has been handed out, someone may try to look the
+    // node up by it, so it has to be in the index from then on.
+    publishIdentity(HERE);
     return _id;
 }
 
 
+void NodePrivate::publishIdentity (codeplace const & cp) const {
+    if (_published.load(std::memory_order_acquire))
+        return;
+
+    // Whichever thread flips the bit does the insert, so a node is never
+    // put in the map twice.
+    if (_published.exchange(true, std::memory_order_acq_rel))
+        return;
+
+    hopefully(
+        globalEngine->_mapIdToNode.insert(_id, const_cast<NodePrivate *>(this)),
+        cp
+    );
+
+    // Anyone who looked this identity up through a tag and came up empty
+    Observer::identitiesChanged({_id});
+}
+
+
+Journal * NodePrivate::maybeJournal () {
+    // Null unless the Engine has a journal open, in which case every
+    // successful mutation is appended to it.
+    return globalEngine->_journal.get();
+}
+
+
 
 //
 // Parent specification
@@ -217,57 +462,53 @@ NodePrivate & NodePrivate::parent (codeplace const & cp) {
 }
 
 
-NodePrivate::relationship_info NodePrivate::relationshipToParent (
-    codeplace const & cp
-) const
-{
+Label NodePrivate::labelInParent (codeplace const & cp) const {
     hopefully(hasParent(), cp);
-    for (auto & labelChildren : _parent->_labelToChildren) {
-        auto iter = std::find(
-            begin(labelChildren.second), end(labelChildren.second), this
-        );
-        if (iter != end(labelChildren.second))
-            return relationship_info (
-                labelChildren.first, labelChildren.second, iter
-            );
-    }
-    throw hopefullyNotReached(HERE);
+    return *_labelInParent;
 }
 
 
-NodePrivate::relationship_info NodePrivate::relationshipToParent (
-    codeplace const & cp
-) {
-    hopefully(hasParent(), cp);
-    for (auto & labelChildren : _parent->_labelToChildren) {
-        auto iter = std::find(
-            begin(labelChildren.second), end(labelChildren.second), this
+NodePrivate const & NodePrivate::root() const {
+    // The cached root is good if the node in that slot is the same root
+    // with the same epoch.  Going through the slot rather than a pointer
+    // means a root that has since been freed is never looked at.
+    quint64 const cached = _cachedRoot.load(std::memory_order_acquire);
+    if (cached != 0) {
+        auto owner = static_cast<NodePrivate const *>(
+            NodePool::current().maybeSlotOwner(
+                static_cast<quint32>(cached) - 1
+            )
         );
-        if (iter != end(labelChildren.second))
-            return relationship_info (
-                labelChildren.first, labelChildren.second, iter
-            );
+        if (
+            owner
+            and owner->_rootEpoch.load(std::memory_order_acquire)
+                == static_cast<quint32>(cached >> 32)
+        ) {
+            return *owner;
+        }
     }
-    throw hopefullyNotReached(HERE);
-}
-
-
 
-
-Label NodePrivate::labelInParent (codeplace const & cp) const {
-    return relationshipToParent(cp)._labelInParent;
-}
-
-
-NodePrivate const & NodePrivate::root() const {
     NodePrivate const * current = this;
     while (current->_parent) {
-        current = _parent->_parent;
+        current = current->_parent;
     }
+
+    _cachedRoot.store(
+        (static_cast<quint64>(current->_rootEpoch.load(std::memory_order_acquire))
+            << 32) | (static_cast<quint64>(current->_slot) + 1),
+        std::memory_order_release
+    );
     return *current;
 }
 
 
+void NodePrivate::renewRootEpoch () const {
+    // Epochs are never reused, so a stale cache can't match again even if
+    // the slot goes to another node
+    _rootEpoch.store(globalEngine->newRootEpoch(), std::memory_order_release);
+}
+
+
 NodePrivate & NodePrivate::root() {
     NodePrivate const & constRef = *this;
     return const_cast<NodePrivate &>(constRef.root());
@@ -301,7 +542,7 @@ QString NodePrivate::text (codeplace const & cp) const {
 // Label-in-AccessorEnumeration
 //
 // Order is not user-controllable.  It is invariant from the ordering
-// specified by methyl::Label::compare()
+// specified by methyl::Tag::compare()
 //
 
 bool NodePrivate::hasAnyLabels () const {
@@ -383,7 +624,7 @@ NodePrivate const & NodePrivate::firstChildInLabel (
 {
     auto iter = _labelToChildren.find(label);
     hopefully(iter != end(_labelToChildren), cp);
-    return *(*iter).second.front();
+    return *(*iter).second._first;
 }
 
 
@@ -403,7 +644,7 @@ NodePrivate const & NodePrivate::lastChildInLabel (
 {
     auto iter = _labelToChildren.find(label);
     hopefully(iter != end(_labelToChildren), cp);
-    return *(*iter).second.back();
+    return *(*iter).second._last;
 }
 
 
@@ -417,9 +658,11 @@ NodePrivate & NodePrivate::lastChildInLabel (
 
 
 bool NodePrivate::hasNextSiblingInLabel () const {
-    relationship_info info = relationshipToParent(HERE);
+    hopefully(hasParent(), HERE);
 
-    return (info._iter + 1) != end(info._siblings.get());
+    // The sibling chain runs across all of the parent's labels, so the next
+    // node is only a sibling "in label" if it has the same label.
+    return _nextSibling and *_nextSibling->_labelInParent == *_labelInParent;
 }
 
 
@@ -427,9 +670,8 @@ NodePrivate const & NodePrivate::nextSiblingInLabel (
     codeplace const & cp
 ) const
 {
-    relationship_info info = relationshipToParent(cp);
-
-    return *(*++info._iter);
+    hopefully(hasNextSiblingInLabel(), cp);
+    return *_nextSibling;
 }
 
 
@@ -442,18 +684,18 @@ NodePrivate & NodePrivate::nextSiblingInLabel (
 
 
 bool NodePrivate::hasPreviousSiblingInLabel () const {
-    relationship_info info = relationshipToParent(HERE);
+    hopefully(hasParent(), HERE);
 
-    return info._iter != begin(info._siblings.get());
+    return _previousSibling
+        and *_previousSibling->_labelInParent == *_labelInParent;
 }
 
 
 NodePrivate const & NodePrivate::previousSiblingInLabel (
     codeplace const & cp
 ) const {
-    relationship_info info = relationshipToParent(cp);
-
-    return *(*--info._iter);
+    hopefully(hasPreviousSiblingInLabel(), cp);
+    return *_previousSibling;
 }
 
 
@@ -472,7 +714,51 @@ NodePrivate & NodePrivate::previousSiblingInLabel (
 
 void NodePrivate::setTag(Tag const & tag) {
     hopefully(hasTag(), HERE);
+    materializeDependents();
     _tag = tag;
+    invalidateSubtreeHash();
+
+    if (Journal * journal = maybeJournal())
+        journal->recordSetTag(*this, tag);
+}
+
+
+NodePrivate * NodePrivate::maybeFirstChild () const {
+    if (_labelToChildren.empty())
+        return nullptr;
+    return (*_labelToChildren.begin()).second._first;
+}
+
+
+void NodePrivate::linkIntoParent (
+    NodePrivate & parent,
+    Label const & label,
+    NodePrivate * previousSibling,
+    NodePrivate * nextSibling
+) {
+    _parent = &parent;
+    _labelInParent = label;
+
+    _previousSibling = previousSibling;
+    if (previousSibling)
+        previousSibling->_nextSibling = this;
+
+    _nextSibling = nextSibling;
+    if (nextSibling)
+        nextSibling->_previousSibling = this;
+}
+
+
+void NodePrivate::unlinkFromParent () {
+    if (_previousSibling)
+        _previousSibling->_nextSibling = _nextSibling;
+    if (_nextSibling)
+        _nextSibling->_previousSibling = _previousSibling;
+
+    _parent = nullptr;
+    _labelInParent = nullopt;
+    _previousSibling = nullptr;
+    _nextSibling = nullptr;
 }
 
 
@@ -483,23 +769,47 @@ NodePrivate::insert_result NodePrivate::insertChildAsFirstInLabel (
     hopefully(not newChild->hasParent(), HERE);
     hopefully(hasTag(), HERE);
 
+    materializeDependents();
+    newChild->materialize();
+    newChild->renewRootEpoch();
+
     NodePrivate * newChildPtr = newChild.release();
-    newChildPtr->_parent = this;
 
     auto iter = _labelToChildren.find(label);
 
+    NodePrivate * nextChild = nullptr;
     if (iter == end(_labelToChildren)) {
-        _labelToChildren.insert(
-            std::make_pair(label, std::vector<NodePrivate *>{newChildPtr})
+        // A new label goes into the sibling chain between the last child of
+        // the label before it and the first child of the label after it.
+        iter = _labelToChildren.insert(
+            std::make_pair(label, child_range {newChildPtr, newChildPtr})
+        ).first;
+
+        newChildPtr->linkIntoParent(
+            *this,
+            label,
+            iter == begin(_labelToChildren)
+                ? nullptr
+                : (*(iter - 1)).second._last,
+            iter + 1 == end(_labelToChildren)
+                ? nullptr
+                : (*(iter + 1)).second._first
         );
-        return insert_result (
-            *newChildPtr,
-            insert_info (nullptr, label, nullptr, nullptr)
+    } else {
+        nextChild = (*iter).second._first;
+        newChildPtr->linkIntoParent(
+            *this, label, nextChild->_previousSibling, nextChild
         );
+        (*iter).second._first = newChildPtr;
     }
+    invalidateSubtreeHash();
 
-    NodePrivate * nextChild = (*iter).second.front();
-    (*iter).second.insert(begin((*iter).second), newChildPtr);
+    if (Journal * journal = maybeJournal()) {
+        journal->recordInsertChild(
+            Journal::Opcode::InsertChildAsFirstInLabel,
+            *this, *newChildPtr, label
+        );
+    }
 
     return insert_result (
         *newChildPtr,
@@ -515,23 +825,45 @@ NodePrivate::insert_result NodePrivate::insertChildAsLastInLabel (
     hopefully(not newChild->hasParent(), HERE);
     hopefully(hasTag(), HERE);
 
+    materializeDependents();
+    newChild->materialize();
+    newChild->renewRootEpoch();
+
     NodePrivate * newChildPtr = newChild.release();
-    newChildPtr->_parent = this;
 
     auto iter = _labelToChildren.find(label);
 
+    NodePrivate * previousChild = nullptr;
     if (iter == end(_labelToChildren)) {
-        _labelToChildren.insert(
-            std::make_pair(label, std::vector<NodePrivate *>{newChildPtr})
+        iter = _labelToChildren.insert(
+            std::make_pair(label, child_range {newChildPtr, newChildPtr})
+        ).first;
+
+        newChildPtr->linkIntoParent(
+            *this,
+            label,
+            iter == begin(_labelToChildren)
+                ? nullptr
+                : (*(iter - 1)).second._last,
+            iter + 1 == end(_labelToChildren)
+                ? nullptr
+                : (*(iter + 1)).second._first
         );
-        return insert_result (
-            *newChildPtr,
-            insert_info (nullptr, label, nullptr, nullptr)
+    } else {
+        previousChild = (*iter).second._last;
+        newChildPtr->linkIntoParent(
+            *this, label, previousChild, previousChild->_nextSibling
         );
+        (*iter).second._last = newChildPtr;
     }
+    invalidateSubtreeHash();
 
-    NodePrivate * previousChild = (*iter).second.back();
-    (*iter).second.push_back(newChildPtr);
+    if (Journal * journal = maybeJournal()) {
+        journal->recordInsertChild(
+            Journal::Opcode::InsertChildAsLastInLabel,
+            *this, *newChildPtr, label
+        );
+    }
 
     return insert_result (
         *newChildPtr,
@@ -543,27 +875,34 @@ NodePrivate::insert_result NodePrivate::insertChildAsLastInLabel (
 NodePrivate::insert_result NodePrivate::insertSiblingAfter (
     unique_ptr<NodePrivate> newSibling
 ) {
+    hopefully(hasParent(), HERE);
     hopefully(not newSibling->hasParent(), HERE);
 
+    materializeDependents();
+    newSibling->materialize();
+    newSibling->renewRootEpoch();
+
     NodePrivate * newSiblingPtr = newSibling.release();
-    newSiblingPtr->_parent = this->_parent;
+    Label const label = *_labelInParent;
 
-    relationship_info info = relationshipToParent(HERE);
+    NodePrivate const * nextChild = maybeNextSiblingInLabel();
 
-    auto nextChild = [&]() -> NodePrivate const * {
-        if (++info._iter == end(info._siblings.get())) {
-            return nullptr;
-        } else {
-            return *info._iter;
-        }
-    }();
+    newSiblingPtr->linkIntoParent(*_parent, label, this, _nextSibling);
+
+    auto iter = _parent->_labelToChildren.find(label);
+    if ((*iter).second._last == this)
+        (*iter).second._last = newSiblingPtr;
+    _parent->invalidateSubtreeHash();
 
-    // we've bumped the iterator... so inserting *after* initial iter
-    info._siblings.get().insert(info._iter, newSiblingPtr);
+    if (Journal * journal = maybeJournal()) {
+        journal->recordInsertSibling(
+            Journal::Opcode::InsertSiblingAfter, *this, *newSiblingPtr
+        );
+    }
 
     return insert_result (
         *newSiblingPtr,
-        insert_info (_parent, info._labelInParent, nullptr, nextChild)
+        insert_info (_parent, label, this, nextChild)
     );
 }
 
@@ -571,25 +910,34 @@ NodePrivate::insert_result NodePrivate::insertSiblingAfter (
 NodePrivate::insert_result NodePrivate::insertSiblingBefore (
     unique_ptr<NodePrivate> newSibling
 ) {
+    hopefully(hasParent(), HERE);
+    hopefully(not newSibling->hasParent(), HERE);
+
+    materializeDependents();
+    newSibling->materialize();
+    newSibling->renewRootEpoch();
+
     NodePrivate * newSiblingPtr = newSibling.release();
-    newSiblingPtr->_parent = this->_parent;
+    Label const label = *_labelInParent;
 
-    relationship_info info = relationshipToParent(HERE);
+    NodePrivate const * previousChild = maybePreviousSiblingInLabel();
 
-    auto previousChild = [&]() -> NodePrivate const * {
-        if (info._iter == begin(info._siblings.get())) {
-            return nullptr;
-        } else {
-            return *(--info._iter);
-        }
-    }();
+    newSiblingPtr->linkIntoParent(*_parent, label, _previousSibling, this);
 
-    // we've bumped the iterator... so inserting *before* initial iter
-    info._siblings.get().insert(info._iter, newSiblingPtr);
+    auto iter = _parent->_labelToChildren.find(label);
+    if ((*iter).second._first == this)
+        (*iter).second._first = newSiblingPtr;
+    _parent->invalidateSubtreeHash();
+
+    if (Journal * journal = maybeJournal()) {
+        journal->recordInsertSibling(
+            Journal::Opcode::InsertSiblingBefore, *this, *newSiblingPtr
+        );
+    }
 
     return insert_result (
         *newSiblingPtr,
-        insert_info (_parent, info._labelInParent, previousChild, nullptr)
+        insert_info (_parent, label, previousChild, this)
     );
 }
 
@@ -599,34 +947,35 @@ auto NodePrivate::detach ()
 {
     hopefully(hasParent(), HERE);
 
-    relationship_info info = relationshipToParent(HERE);
+    materializeDependents();
 
-    auto previousChild = [&]() -> NodePrivate const * {
-        if (info._iter == begin(info._siblings.get())) {
-            return nullptr;
-        } else {
-            return *(info._iter - 1);
-        }
-    }();
+    NodePrivate & parent = *_parent;
+    Label const label = *_labelInParent;
+    NodePrivate const & oldRoot = root();
 
-    auto nextChild = [&]() -> NodePrivate const * {
-        if (info._iter == end(info._siblings.get())) {
-            return nullptr;
-        } else {
-            return *(info._iter + 1);
-        }
-    }();
+    NodePrivate * previousChild = maybePreviousSiblingInLabel();
+    NodePrivate * nextChild = maybeNextSiblingInLabel();
 
-    info._siblings.get().erase(info._iter);
-    if (info._siblings.get().empty()) {
-        _parent->_labelToChildren.erase(info._labelInParent);
+    auto iter = parent._labelToChildren.find(label);
+    if (not previousChild and not nextChild) {
+        parent._labelToChildren.erase(iter);
+    } else {
+        if (not previousChild)
+            (*iter).second._first = nextChild;
+        if (not nextChild)
+            (*iter).second._last = previousChild;
     }
 
-    this->_parent = nullptr;
+    unlinkFromParent();
+    oldRoot.renewRootEpoch();
+    parent.invalidateSubtreeHash();
+
+    if (Journal * journal = maybeJournal())
+        journal->recordDetach(*this);
 
     return make_tuple(
         unique_ptr<NodePrivate> (this),
-        detach_info (*_parent, info._labelInParent, previousChild, nextChild)
+        detach_info (parent, label, previousChild, nextChild)
     );
 }
 
@@ -637,34 +986,42 @@ auto NodePrivate::replaceWith (
     -> tuple<unique_ptr<NodePrivate>, NodePrivate::detach_info>
 {
     hopefully(hasParent(), HERE);
+    hopefully(not replacement->hasParent(), HERE);
 
-    NodePrivate * replacementPtr = replacement.release();
-    replacementPtr->_parent = this->_parent;
+    materializeDependents();
+    replacement->materialize();
 
-    relationship_info info = relationshipToParent(HERE);
-
-    auto previousChild = [&]() -> NodePrivate const * {
-        if (info._iter == begin(info._siblings.get())) {
-            return nullptr;
-        } else {
-            return *(info._iter - 1);
-        }
-    }();
+    NodePrivate * replacementPtr = replacement.release();
 
-    auto nextChild = [&]() -> NodePrivate const * {
-        if (info._iter == end(info._siblings.get())) {
-            return nullptr;
-        } else {
-            return *(info._iter + 1);
-        }
-    }();
+    NodePrivate & parent = *_parent;
+    Label const label = *_labelInParent;
+    NodePrivate const & oldRoot = root();
+
+    NodePrivate const * previousChild = maybePreviousSiblingInLabel();
+    NodePrivate const * nextChild = maybeNextSiblingInLabel();
+
+    auto iter = parent._labelToChildren.find(label);
+    if ((*iter).second._first == this)
+        (*iter).second._first = replacementPtr;
+    if ((*iter).second._last == this)
+        (*iter).second._last = replacementPtr;
+
+    NodePrivate * previousSibling = _previousSibling;
+    NodePrivate * nextSibling = _nextSibling;
+    unlinkFromParent();
+    oldRoot.renewRootEpoch();
+    replacementPtr->renewRootEpoch();
+    replacementPtr->linkIntoParent(
+        parent, label, previousSibling, nextSibling
+    );
+    parent.invalidateSubtreeHash();
 
-    *info._iter = replacementPtr;
-    this->_parent = nullptr;
+    if (Journal * journal = maybeJournal())
+        journal->recordReplaceWith(*this, *replacementPtr);
 
     return make_tuple(
         unique_ptr<NodePrivate> (this),
-        detach_info (*_parent, info._labelInParent, previousChild, nextChild)
+        detach_info (parent, label, previousChild, nextChild)
     );
 }
 
@@ -673,7 +1030,12 @@ void NodePrivate::setText (
     QString const & text
 ) {
     hopefully(hasText(), HERE);
+    materializeDependents();
     _text = text;
+    invalidateSubtreeHash();
+
+    if (Journal * journal = maybeJournal())
+        journal->recordSetText(*this, text);
 }
 
 
@@ -681,36 +1043,183 @@ void NodePrivate::setText (
 // Tree Walking and comparison
 //
 
+namespace {
+
+// Mixing step in the style of boost::hash_combine; unlike XOR, the order
+// in which values are combined changes the result
+inline size_t combineHash (size_t seed, size_t value) {
+    return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+size_t const textHashSalt = 0x5bd1e995;
+
+} // end anonymous namespace
+
+
+void NodePrivate::invalidateSubtreeHash () {
+    NodePrivate * node = this;
+    while (node and node->_subtreeHash.load(std::memory_order_relaxed) != 0) {
+        node->_subtreeHash.store(0, std::memory_order_relaxed);
+        node->_subtreeSize.store(0, std::memory_order_relaxed);
+        node = node->_parent;
+    }
+}
+
+
+size_t NodePrivate::hashOfContentAndChildren () const {
+    size_t result = hasTag()
+        ? std::hash<Tag>()(*_tag)
+        : combineHash(textHashSalt, qHash(*_text));
+
+    for (auto const & entry : _labelToChildren) {
+        result = combineHash(result, std::hash<Label>()(entry.first));
+
+        NodePrivate const * child = entry.second._first;
+        while (true) {
+            result = combineHash(
+                result, child->_subtreeHash.load(std::memory_order_relaxed)
+            );
+            if (child == entry.second._last)
+                break;
+            child = child->_nextSibling;
+        }
+    }
+
+    // Zero means "not computed"
+    return result == 0 ? 1 : result;
+}
+
+
+void NodePrivate::computeSubtreeSummary () const {
+    // Postorder, so every child is done before its parent, without
+    // recursion.  Subtrees that already have a hash are not entered.
+    auto firstToHash = [](NodePrivate const * node) {
+        while (node->_subtreeHash.load(std::memory_order_acquire) == 0) {
+            NodePrivate const * child = node->maybeFirstChild();
+            if (not child)
+                break;
+            node = child;
+        }
+        return node;
+    };
+
+    NodePrivate const * node = firstToHash(this);
+    while (true) {
+        if (node->_subtreeHash.load(std::memory_order_acquire) == 0) {
+            size_t size = 1;
+            for (
+                NodePrivate const * child = node->maybeFirstChild();
+                child;
+                child = child->_nextSibling
+            ) {
+                size += child->_subtreeSize.load(std::memory_order_relaxed);
+            }
+
+            node->_subtreeSize.store(size, std::memory_order_relaxed);
+            node->_subtreeHash.store(
+                node->hashOfContentAndChildren(), std::memory_order_release
+            );
+        }
+
+        if (node == this)
+            break;
+
+        if (node->_nextSibling)
+            node = firstToHash(node->_nextSibling);
+        else
+            node = node->_parent;
+    }
+}
+
+
+size_t NodePrivate::subtreeHash () const {
+    // A pending clone would otherwise hash as a childless node
+    materialize();
+
+    size_t const cached = _subtreeHash.load(std::memory_order_acquire);
+    if (cached != 0)
+        return cached;
+
+    computeSubtreeSummary();
+    return _subtreeHash.load(std::memory_order_acquire);
+}
+
+
+size_t NodePrivate::subtreeSize () const {
+    materialize();
+
+    if (_subtreeHash.load(std::memory_order_acquire) == 0)
+        computeSubtreeSummary();
+    return _subtreeSize.load(std::memory_order_relaxed);
+}
+
+
+namespace {
+
+inline int sign (int value) {
+    return (value > 0) - (value < 0);
+}
+
+} // end anonymous namespace
+
+
 int NodePrivate::compare (NodePrivate const & other) const {
+    if (this == &other)
+        return 0;
+
+    // Only roots can be pending, so filling in these two covers the walk
+    materialize();
+    other.materialize();
+
     NodePrivate const * thisCur = this;
     NodePrivate const * otherCur = &other;
 
     do {
-        if (thisCur->hasText() and not otherCur->hasText())
-            return -1;
-        if (not thisCur->hasText() and otherCur->hasText())
-            return 1;
-        if (thisCur->hasText() and otherCur->hasText()) {
-            int cmp = thisCur->text(HERE).compare(otherCur->text(HERE));
-            if (cmp != 0)
-                return cmp;
-        } else {
-            int cmp = thisCur->tag(HERE).compare(otherCur->tag(HERE));
+        if (thisCur->hasText() != otherCur->hasText())
+            return thisCur->hasText() ? -1 : 1;
+
+        int cmp = thisCur->hasText()
+            ? thisCur->_text->compare(*otherCur->_text)
+            : thisCur->_tag->compare(*otherCur->_tag);
+        if (cmp != 0)
+            return sign(cmp);
+
+        // Below the roots, which label a node is in matters too
+        if (thisCur != this) {
+            cmp = static_cast<Tag const &>(*thisCur->_labelInParent).compare(
+                static_cast<Tag const &>(*otherCur->_labelInParent)
+            );
             if (cmp != 0)
-                return cmp;
-            if (thisCur->tag(HERE) != otherCur->tag(HERE))
-                return false;
+                return sign(cmp);
         }
+
+        // Matching the preorder sequence alone would say a(b(c)) and
+        // a(b, c) are the same.  Whether each node has a first child and a
+        // next sibling (ignoring the roots' siblings) pins down the shape.
+        bool const thisHasChild = thisCur->maybeFirstChild() != nullptr;
+        bool const otherHasChild = otherCur->maybeFirstChild() != nullptr;
+        if (thisHasChild != otherHasChild)
+            return thisHasChild ? 1 : -1;
+
+        bool const thisHasNext = thisCur != this and thisCur->_nextSibling;
+        bool const otherHasNext = otherCur != &other and otherCur->_nextSibling;
+        if (thisHasNext != otherHasNext)
+            return thisHasNext ? 1 : -1;
+
         thisCur = thisCur->maybeNextPreorderNodeUnderRoot(*this);
         otherCur = otherCur->maybeNextPreorderNodeUnderRoot(other);
     } while (thisCur and otherCur);
 
-    if (thisCur and not otherCur)
-        return -1;
-    if (otherCur and not thisCur)
-        return 1;
-
+    // Same shape all the way means both walks end together
+    hopefully(not thisCur and not otherCur, HERE);
     return 0;
 }
 
 } // namespace methyl
+
+
+void std::default_delete<methyl::NodePrivate>::operator() (
+    methyl::NodePrivate * nodePrivate
+) const {
+    methyl::NodePrivate::destroySubtree(nodePrivate);
+}
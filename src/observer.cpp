@@ -34,7 +34,7 @@ QDebug & operator<< (
 
     for (
         SeenFlags saw = SeenFlags::HasTag;
-        saw <= SeenFlags::Data;
+        saw <= SeenFlags::Children;
         saw = static_cast<SeenFlags>(
             static_cast<int>(saw) << 1
         )
@@ -80,6 +80,18 @@ QDebug & operator<< (
             case SeenFlags::Data:
                 o << "Data";
                 break;
+            case SeenFlags::ParentEquality:
+                o << "ParentEquality";
+                break;
+            case SeenFlags::LabelInParentEquality:
+                o << "LabelInParentEquality";
+                break;
+            case SeenFlags::TagEquality:
+                o << "TagEquality";
+                break;
+            case SeenFlags::Children:
+                o << "Children";
+                break;
             default:
                 throw hopefullyNotReached(HERE);
             }
@@ -105,11 +117,21 @@ Observer & Observer::current () {
 }
 
 
+namespace {
+
+std::atomic<quint64> nextObserverSerial (1);
+
+} // end anonymous namespace
+
+
 Observer::Observer (
     std::unordered_set<Node<Accessor const>> const & watchedRoots,
     codeplace const & cp
 ) :
-    _map (std::unordered_map<NodePrivate const *, SeenFlags>())
+    _serial (nextObserverSerial.fetch_add(1)),
+    _blinded (false),
+    _dirty (false),
+    _incremental (false)
 {
     Q_UNUSED(cp);
 
@@ -118,7 +140,7 @@ Observer::Observer (
         // Have to reach underneath and use the NodePrivate function
         auto & rootPrivate = root.accessor().nodePrivate();
         hopefully(not rootPrivate.hasParent(), HERE);
-        _watchedRoots.insert(&rootPrivate);
+        _watchedRoots.push_back(WatchedRoot {&rootPrivate, rootPrivate._slot});
     }
 
     QWriteLocker lock (&globalEngine->_observersLock);
@@ -141,20 +163,192 @@ Observer::Observer (
 //
 
 bool Observer::isBlinded() {
-    QReadLocker lock (&_mapLock);
-    return _map == nullopt;
+    return _blinded.load(std::memory_order_acquire);
 }
 
 
-Observer::SeenFlags Observer::getSeenFlags (NodePrivate const & node) const {
-    QReadLocker lock (&_mapLock);
+void Observer::markBlind () {
+    _blinded.store(true, std::memory_order_release);
 
-    hopefully(_map != nullopt, HERE);
-    auto it = (*_map).find(&node);
-    if (it == (*_map).end()) {
-        return SeenFlags::None;
+    // Nothing recorded matters anymore, so let go of the memory
+    {
+        QMutexLocker lock (&_buffersMutex);
+        for (auto & buffer : _buffers) {
+            while (buffer->_busy.test_and_set(std::memory_order_acquire))
+                ;
+            buffer->_count = 0;
+            buffer->_busy.clear(std::memory_order_release);
+        }
+    }
+    {
+        QWriteLocker lock (&_tableLock);
+        _pages.clear();
+    }
+    {
+        QMutexLocker lock (&_comparisonsLock);
+        _comparisons.clear();
+    }
+    forgetInterests();
+
+    emit blinded();
+}
+
+
+Observer::ThreadBuffer & Observer::bufferForThisThread () {
+    // Most of the time a thread keeps recording into the same observer, so
+    // remember the last one it used.
+    struct CachedBuffer {
+        quint64 _serial = 0;
+        ThreadBuffer * _buffer = nullptr;
+    };
+    static thread_local CachedBuffer cached;
+
+    if (cached._serial == _serial)
+        return *cached._buffer;
+
+    std::thread::id const thread = std::this_thread::get_id();
+
+    QMutexLocker lock (&_buffersMutex);
+
+    ThreadBuffer * result = nullptr;
+    for (auto & buffer : _buffers) {
+        if (buffer->_thread == thread) {
+            result = buffer.get();
+            break;
+        }
+    }
+    if (not result) {
+        _buffers.emplace_back(new ThreadBuffer (thread));
+        result = _buffers.back().get();
+    }
+
+    cached._serial = _serial;
+    cached._buffer = result;
+    return *result;
+}
+
+
+void Observer::applyBuffer (ThreadBuffer & buffer) {
+    // Only flags this observer hadn't already recorded for a node need to
+    // go into the engine's reverse index.
+    std::vector<SeenEntry> added;
+
+    for (size_t index = 0; index < buffer._count; index++) {
+        SeenEntry const & entry = buffer._entries[index];
+
+        size_t const page = entry._slot / pageSize;
+        if (page >= _pages.size())
+            _pages.resize(page + 1);
+        if (not _pages[page]) {
+            _pages[page].reset(new SeenPage);
+            _pages[page]->fill(0);
+        }
+
+        quint32 & seen = (*_pages[page])[entry._slot % pageSize];
+        if ((seen | entry._flags) != seen) {
+            seen |= entry._flags;
+            added.push_back(SeenEntry {entry._slot, seen});
+        }
+    }
+    buffer._count = 0;
+
+    if (added.empty())
+        return;
+
+    // Take each stripe of the reverse index once, rather than once per entry
+    std::sort(begin(added), end(added),
+        [](SeenEntry const & left, SeenEntry const & right) {
+            return left._slot % Engine::interestStripeCount
+                < right._slot % Engine::interestStripeCount;
+        }
+    );
+
+    std::vector<quint32> newSlots;
+    auto entry = begin(added);
+    while (entry != end(added)) {
+        auto & stripe = globalEngine->interestStripe(entry->_slot);
+        QMutexLocker lock (&stripe._lock);
+
+        do {
+            auto & list = globalEngine->interests(entry->_slot);
+            auto iter = std::find_if(begin(list), end(list),
+                [this](Interest const & interest) {
+                    return interest._observer == this;
+                }
+            );
+            if (iter == end(list)) {
+                list.push_back(Interest {this, entry->_flags});
+                newSlots.push_back(entry->_slot);
+            } else
+                iter->_flags = entry->_flags;
+            ++entry;
+        } while (
+            entry != end(added)
+            and &globalEngine->interestStripe(entry->_slot) == &stripe
+        );
+    }
+
+    // Only after the index has them, so forgetInterests can't miss any
+    QMutexLocker lock (&_interestSlotsLock);
+    _interestSlots.insert(begin(newSlots), end(newSlots));
+}
+
+
+void Observer::forgetInterests () {
+    std::unordered_set<quint32> slots;
+    {
+        QMutexLocker lock (&_interestSlotsLock);
+        slots.swap(_interestSlots);
+    }
+    {
+        QMutexLocker lock (&_comparisonsLock);
+        globalEngine->_identityLookupCount -= _identityLookups.size();
+        _identityLookups.clear();
+    }
+
+    for (quint32 slot : slots) {
+        auto & stripe = globalEngine->interestStripe(slot);
+        QMutexLocker lock (&stripe._lock);
+
+        auto list = globalEngine->maybeInterests(slot);
+        if (not list)
+            continue;
+        list->erase(
+            std::remove_if(begin(*list), end(*list),
+                [this](Interest const & interest) {
+                    return interest._observer == this;
+                }
+            ),
+            end(*list)
+        );
     }
-    return it->second;
+}
+
+
+void Observer::mergePending () {
+    QMutexLocker buffersLock (&_buffersMutex);
+    QWriteLocker tableLock (&_tableLock);
+
+    for (auto & buffer : _buffers) {
+        while (buffer->_busy.test_and_set(std::memory_order_acquire))
+            ;
+        applyBuffer(*buffer);
+        buffer->_busy.clear(std::memory_order_release);
+    }
+}
+
+
+Observer::SeenFlags Observer::getSeenFlags (NodePrivate const & node) {
+    hopefully(not isBlinded(), HERE);
+
+    mergePending();
+
+    QReadLocker lock (&_tableLock);
+
+    size_t const page = node._slot / pageSize;
+    if (page >= _pages.size() or not _pages[page])
+        return SeenFlags::None;
+    return static_cast<SeenFlags>((*_pages[page])[node._slot % pageSize]);
 }
 
 
@@ -165,19 +359,139 @@ void Observer::addSeenFlags (
 ) {
     Q_UNUSED(cp);
 
-    QWriteLocker lock (&_mapLock);
-
-    if (_map == nullopt)
+    if (_blinded.load(std::memory_order_relaxed))
         return;
 
-    auto it = (*_map).find(&node);
-    if (it == (*_map).end()) {
-        (*_map).insert(
-            std::pair<NodePrivate const *, SeenFlags>(&node, flags)
-        );
-    } else {
-        it->second = it->second | flags;
+    ThreadBuffer & buffer = bufferForThisThread();
+
+    while (true) {
+        while (buffer._busy.test_and_set(std::memory_order_acquire))
+            ;
+
+        if (buffer._count < ThreadBuffer::capacity) {
+            SeenEntry & entry = buffer._entries[buffer._count++];
+            entry._slot = node._slot;
+            entry._flags = static_cast<quint32>(flags);
+
+            buffer._busy.clear(std::memory_order_release);
+
+            // Let the engine know there's something to merge before the
+            // next write looks at the reverse index.
+            if (not _dirty.load(std::memory_order_relaxed)) {
+                if (not _dirty.exchange(true, std::memory_order_acq_rel)) {
+                    QMutexLocker lock (&globalEngine->_dirtyLock);
+                    globalEngine->_dirtyObservers.push_back(this);
+                }
+            }
+            return;
+        }
+
+        // Full.  The flag has to be dropped before merging, as the merge
+        // will want to take it (along with everyone else's).
+        buffer._busy.clear(std::memory_order_release);
+        mergePending();
+    }
+}
+
+
+void Observer::addComparison (
+    NodePrivate const & node,
+    Comparison && comparison
+) {
+    QMutexLocker lock (&_comparisonsLock);
+
+    // The same question asked again (say, on every pass of a loop) only
+    // needs to be remembered once
+    auto & list = _comparisons[node._slot];
+    for (Comparison & existing : list) {
+        if (
+            existing._kind == comparison._kind
+            and existing._parent == comparison._parent
+            and existing._label == comparison._label
+            and existing._tag == comparison._tag
+        ) {
+            existing._result = comparison._result;
+            return;
+        }
+    }
+    list.push_back(std::move(comparison));
+}
+
+
+void Observer::addIdentityLookup (
+    Identity const & id,
+    NodePrivate const & node
+) {
+    QMutexLocker lock (&_comparisonsLock);
+
+    auto & slots = _identityLookups[id];
+    if (slots.empty())
+        globalEngine->_identityLookupCount++;
+    if (std::find(begin(slots), end(slots), node._slot) == end(slots))
+        slots.push_back(node._slot);
+}
+
+
+Observer::SeenFlags Observer::narrowHit (quint32 slot, SeenFlags hit) {
+    SeenFlags const predicates = SeenFlags::ParentEquality
+        | SeenFlags::LabelInParentEquality
+        | SeenFlags::TagEquality;
+
+    if ((hit & predicates) == SeenFlags::None)
+        return hit;
+
+    auto node = static_cast<NodePrivate const *>(
+        NodePool::current().maybeSlotOwner(slot)
+    );
+    if (not node)
+        return hit;
+
+    QMutexLocker lock (&_comparisonsLock);
+
+    auto iter = _comparisons.find(slot);
+    if (iter == end(_comparisons))
+        return hit;
+
+    // A kind of predicate is only still hit if one of its answers changed.
+    // (With no answers on record, stay conservative and leave it hit.)
+    SeenFlags recorded = SeenFlags::None;
+    SeenFlags changed = SeenFlags::None;
+
+    for (Comparison const & comparison : iter->second) {
+        if ((hit & comparison._kind) == SeenFlags::None)
+            continue;
+
+        bool now;
+        switch (comparison._kind) {
+        case SeenFlags::ParentEquality:
+            now = node->_parent and node->_parent->_id == *comparison._parent;
+            break;
+
+        case SeenFlags::LabelInParentEquality:
+            now = node->_labelInParent
+                and *node->_labelInParent == *comparison._label;
+            break;
+
+        case SeenFlags::TagEquality:
+            now = node->_tag and *node->_tag == *comparison._tag;
+            break;
+
+        default:
+            throw hopefullyNotReached(HERE);
+        }
+
+        recorded = recorded | comparison._kind;
+        if (now != comparison._result)
+            changed = changed | comparison._kind;
     }
+
+    typedef std::underlying_type<SeenFlags>::type ut;
+    SeenFlags const unchanged = static_cast<SeenFlags>(
+        static_cast<ut>(recorded) & ~static_cast<ut>(changed)
+    );
+    return static_cast<SeenFlags>(
+        static_cast<ut>(hit) & ~static_cast<ut>(unchanged)
+    );
 }
 
 
@@ -196,6 +510,13 @@ bool Observer::maybeObserved (
 //
 
 // node in label enumeration
+void Observer::children (NodePrivate const & thisNode) {
+    // One observation stands in for all the per-step reads a range would
+    // otherwise make; any insert or detach under the node will invalidate
+    addSeenFlags(thisNode, SeenFlags::Children, HERE);
+}
+
+
 void Observer::firstChildInLabel (
     NodePrivate const & result,
     NodePrivate const & thisNode,
@@ -258,11 +579,13 @@ void Observer::hasParentEqualTo (
     NodePrivate const & thisNode,
     NodePrivate const & parent
 ) {
-    // TODO: implement this
-    Q_UNUSED(result);
-    Q_UNUSED(thisNode);
-    Q_UNUSED(parent);
-    notImplemented("hasParentEqualTo", HERE);
+    if (isBlinded())
+        return;
+
+    addSeenFlags(thisNode, SeenFlags::ParentEquality, HERE);
+    addComparison(thisNode, Comparison {
+        SeenFlags::ParentEquality, parent._id, nullopt, nullopt, result
+    });
 }
 
 
@@ -271,11 +594,13 @@ void Observer::hasLabelInParentEqualTo (
     NodePrivate const & thisNode,
     Label const & label
 ) {
-    // TODO: implement this
-    Q_UNUSED(result);
-    Q_UNUSED(thisNode);
-    Q_UNUSED(label);
-    notImplemented("hasLabelInParentEqualTo", HERE);
+    if (isBlinded())
+        return;
+
+    addSeenFlags(thisNode, SeenFlags::LabelInParentEquality, HERE);
+    addComparison(thisNode, Comparison {
+        SeenFlags::LabelInParentEquality, nullopt, label, nullopt, result
+    });
 }
 
 
@@ -296,11 +621,13 @@ void Observer::hasTagEqualTo (
     NodePrivate const & thisNode,
     methyl::Tag const & tag
 ) {
-    // TODO: implement this
-    Q_UNUSED(result);
-    Q_UNUSED(thisNode);
-    Q_UNUSED(tag);
-    notImplemented("hasTagEqualTo", HERE);
+    if (isBlinded())
+        return;
+
+    addSeenFlags(thisNode, SeenFlags::TagEquality, HERE);
+    addComparison(thisNode, Comparison {
+        SeenFlags::TagEquality, nullopt, nullopt, tag, result
+    });
 }
 
 
@@ -317,10 +644,28 @@ void Observer::tryGetTagNode (
     NodePrivate const * result,
     NodePrivate const & thisNode
 ) {
-    // TODO: implement this
     Q_UNUSED(result);
-    Q_UNUSED(thisNode);
-    notImplemented("tryGetTagNode", HERE);
+
+    if (isBlinded())
+        return;
+
+    // Text nodes never get tags, so finding out that there isn't one is
+    // permanent.  Otherwise the lookup can come out differently if the tag
+    // is changed, or if the node it names is created or freed.
+    if (not thisNode.hasTag()) {
+        addSeenFlags(thisNode, SeenFlags::HasTag, HERE);
+        return;
+    }
+
+    addSeenFlags(thisNode, SeenFlags::TagEquality, HERE);
+    addComparison(thisNode, Comparison {
+        SeenFlags::TagEquality, nullopt, nullopt, *thisNode._tag, true
+    });
+
+    // The answer also depends on whether the node the tag names exists,
+    // which is its own interest (see identitiesChanged)
+    if (optional<Identity> id = thisNode._tag->maybeAsIdentity())
+        addIdentityLookup(*id, thisNode);
 }
 
 
@@ -469,8 +814,407 @@ void Observer::text (
 
 //
 // WRITE OPERATIONS
-// Invalidate any observer which has an interest in this write
 //
+// Each write works out which (node, flags) observations it could change,
+// and the engine's reverse index from node slot to interested observers
+// says who saw any of them.  Only those observers are visited, so a write
+// costs the same no matter how many observers are alive.
+//
+
+void Observer::drainDirtyObservers () {
+    // caller holds the engine's _observersLock for reading, so none of the
+    // observers on the list can be destroyed out from under us
+    std::vector<Observer *> dirty;
+    {
+        QMutexLocker lock (&globalEngine->_dirtyLock);
+        dirty.swap(globalEngine->_dirtyObservers);
+    }
+
+    for (Observer * observer : dirty) {
+        observer->_dirty.store(false, std::memory_order_release);
+        if (not observer->isBlinded())
+            observer->mergePending();
+    }
+}
+
+
+namespace {
+
+// Writes made inside of Engine::batch() on this thread are collected here
+// instead of being checked against observers one at a time.
+thread_local int batchDepth = 0;
+thread_local std::vector<Observer::SlotChange> batchChanges;
+
+} // end anonymous namespace
+
+
+bool Observer::watches (SlotChange const & change) const {
+    // An observer that named no roots hears about everything
+    if (_watchedRoots.empty())
+        return true;
+
+    for (WatchedRoot const & watched : _watchedRoots) {
+        // A watched root may since have been put inside another tree, and
+        // then writes anywhere in that tree are reported against its root.
+        NodePrivate const * resolved = watched._node;
+        if (NodePool::current().maybeSlotOwner(watched._slot) == watched._node)
+            resolved = &watched._node->root();
+
+        for (NodePrivate const * root : change._roots) {
+            if (root and (root == watched._node or root == resolved))
+                return true;
+        }
+    }
+    return false;
+}
+
+
+void Observer::invalidate (
+    std::vector<Invalidation> const & changes,
+    NodePrivate const & where,
+    NodePrivate const * movedFrom,
+    NodePrivate const * movedTo
+) {
+    // A write's changes are in the tree containing the node it was made on,
+    // plus the tree a subtree came from or went to if it moved one.
+    // Observers not watching any of those roots get skipped without looking
+    // at what they saw.
+    std::array<NodePrivate const *, 3> const roots {{
+        &where.root(), movedFrom, movedTo
+    }};
+
+    // Nodes may be freed before a batch finishes, so remember slots rather
+    // than pointers.  At worst a slot gets reused by then and the check is
+    // a false positive.  (The root pointer is only ever compared.)
+    std::vector<SlotChange> slotChanges;
+    slotChanges.reserve(changes.size());
+    for (Invalidation const & change : changes)
+        slotChanges.push_back(
+            SlotChange {change.first->_slot, change.second, roots}
+        );
+
+    if (batchDepth != 0) {
+        batchChanges.insert(
+            end(batchChanges), begin(slotChanges), end(slotChanges)
+        );
+        return;
+    }
+
+    invalidateSlots(slotChanges);
+}
+
+
+void Observer::invalidateSlots (std::vector<SlotChange> const & changes) {
+    QReadLocker observersLock (&globalEngine->_observersLock);
+
+    drainDirtyObservers();
+
+    // For each observer that's hit, exactly which of its observations are
+    // affected
+    std::vector<
+        std::pair<Observer *, std::vector<std::pair<quint32, SeenFlags>>>
+    > affected;
+
+    for (SlotChange const & change : changes) {
+        quint32 const slot = change._slot;
+
+        auto & stripe = globalEngine->interestStripe(slot);
+        QMutexLocker lock (&stripe._lock);
+
+        auto list = globalEngine->maybeInterests(slot);
+        if (not list)
+            continue;
+
+        for (Interest const & interest : *list) {
+            SeenFlags const hit = static_cast<SeenFlags>(interest._flags)
+                & change._flags;
+            if (hit == SeenFlags::None)
+                continue;
+
+            if (not interest._observer->watches(change))
+                continue;
+
+            auto iter = std::find_if(begin(affected), end(affected),
+                [&](decltype(affected)::value_type const & entry) {
+                    return entry.first == interest._observer;
+                }
+            );
+            if (iter == end(affected)) {
+                affected.emplace_back(
+                    interest._observer,
+                    std::vector<std::pair<quint32, SeenFlags>> ()
+                );
+                iter = end(affected) - 1;
+            }
+            iter->second.emplace_back(slot, hit);
+        }
+    }
+
+    for (auto & entry : affected) {
+        Observer & observer = *entry.first;
+        if (observer.isBlinded())
+            continue;
+
+        auto & hits = entry.second;
+        for (auto & hit : hits)
+            hit.second = observer.narrowHit(hit.first, hit.second);
+        hits.erase(
+            std::remove_if(begin(hits), end(hits),
+                [](std::pair<quint32, SeenFlags> const & hit) {
+                    return hit.second == SeenFlags::None;
+                }
+            ),
+            end(hits)
+        );
+        if (hits.empty())
+            continue;
+
+        if (observer.isIncremental())
+            observer.invalidatePartially(entry.second);
+        else
+            observer.markBlind();
+    }
+}
+
+
+void Observer::invalidatePartially (
+    std::vector<std::pair<quint32, SeenFlags>> const & changes
+) {
+    typedef std::underlying_type<SeenFlags>::type ut;
+
+    // Forget just these observations, in both the table and the engine's
+    // reverse index.  If the client looks again, they get recorded again.
+    {
+        QWriteLocker lock (&_tableLock);
+        for (auto const & change : changes) {
+            size_t const page = change.first / pageSize;
+            if (page < _pages.size() and _pages[page]) {
+                (*_pages[page])[change.first % pageSize]
+                    &= ~static_cast<ut>(change.second);
+            }
+        }
+    }
+    for (auto const & change : changes) {
+        auto & stripe = globalEngine->interestStripe(change.first);
+        QMutexLocker lock (&stripe._lock);
+
+        auto list = globalEngine->maybeInterests(change.first);
+        if (not list)
+            continue;
+        for (auto iter = begin(*list); iter != end(*list); ++iter) {
+            if (iter->_observer != this)
+                continue;
+            iter->_flags &= ~static_cast<ut>(change.second);
+            if (iter->_flags == 0)
+                list->erase(iter);
+            break;
+        }
+    }
+
+    {
+        QMutexLocker lock (&_comparisonsLock);
+        for (auto const & change : changes) {
+            auto iter = _comparisons.find(change.first);
+            if (iter == end(_comparisons))
+                continue;
+            auto & list = iter->second;
+            list.erase(
+                std::remove_if(begin(list), end(list),
+                    [&](Comparison const & comparison) {
+                        return (comparison._kind & change.second)
+                            != SeenFlags::None;
+                    }
+                ),
+                end(list)
+            );
+        }
+    }
+
+    {
+        QMutexLocker lock (&_invalidationsLock);
+        _invalidations.insert(
+            end(_invalidations), begin(changes), end(changes)
+        );
+    }
+
+    emit invalidated();
+}
+
+
+std::vector<std::pair<Node<Accessor const>, Observer::SeenFlags>>
+Observer::takeInvalidations () {
+    std::vector<std::pair<quint32, SeenFlags>> taken;
+    {
+        QMutexLocker lock (&_invalidationsLock);
+        taken.swap(_invalidations);
+    }
+
+    // The same node may have been hit by several writes since last time
+    std::sort(begin(taken), end(taken),
+        [](std::pair<quint32, SeenFlags> const & left,
+            std::pair<quint32, SeenFlags> const & right
+        ) {
+            return left.first < right.first;
+        }
+    );
+
+    std::vector<std::pair<Node<Accessor const>, SeenFlags>> result;
+    shared_ptr<Context> context = globalEngine->contextForLookup();
+
+    for (size_t index = 0; index < taken.size(); index++) {
+        SeenFlags flags = taken[index].second;
+        while (
+            index + 1 < taken.size()
+            and taken[index + 1].first == taken[index].first
+        ) {
+            flags = flags | taken[++index].second;
+        }
+
+        // A freed node's slot may have been given to a new node since, in
+        // which case the new one is reported.  That's a false positive, which
+        // observers are always allowed to have.
+        auto nodePrivate = static_cast<NodePrivate const *>(
+            NodePool::current().maybeSlotOwner(taken[index].first)
+        );
+        if (not nodePrivate)
+            continue;
+
+        result.emplace_back(Node<Accessor const> (nodePrivate, context), flags);
+    }
+    return result;
+}
+
+
+void Observer::beginBatch () {
+    batchDepth++;
+}
+
+
+void Observer::endBatch () {
+    hopefully(batchDepth > 0, HERE);
+    if (--batchDepth != 0)
+        return;
+
+    std::vector<SlotChange> changes;
+    changes.swap(batchChanges);
+    if (changes.empty())
+        return;
+
+    // Coalesce to one entry per slot (and tree), so a node touched a
+    // thousand times in the batch is only looked up once.
+    std::sort(begin(changes), end(changes),
+        [](SlotChange const & left, SlotChange const & right) {
+            return std::tie(left._slot, left._roots)
+                < std::tie(right._slot, right._roots);
+        }
+    );
+
+    size_t out = 0;
+    for (size_t index = 1; index < changes.size(); index++) {
+        if (
+            changes[index]._slot == changes[out]._slot
+            and changes[index]._roots == changes[out]._roots
+        ) {
+            changes[out]._flags = changes[out]._flags | changes[index]._flags;
+        } else
+            changes[++out] = changes[index];
+    }
+    changes.resize(out + 1);
+
+    invalidateSlots(changes);
+}
+
+
+void Observer::endBatchUnwinding () noexcept {
+    try {
+        endBatch();
+        return;
+    }
+    catch (...) {
+    }
+
+    // Not knowing which observers the writes hit, assume they all were.
+    // Anything failing past this point leaves nothing better to try.
+    try {
+        QReadLocker lock (&globalEngine->_observersLock);
+        for (Observer * observer : globalEngine->_observers) {
+            if (not observer->isBlinded())
+                observer->markBlind();
+        }
+    }
+    catch (...) {
+    }
+}
+
+
+void Observer::identitiesChanged (std::vector<Identity> const & ids) {
+    if (globalEngine->_identityLookupCount.load(std::memory_order_acquire) == 0)
+        return;
+
+    QReadLocker observersLock (&globalEngine->_observersLock);
+
+    for (Observer * observer : globalEngine->_observers) {
+        // The lookup counts as one observation of the tag on each node that
+        // named the identity, and is used up by being invalidated
+        std::vector<std::pair<quint32, SeenFlags>> hits;
+        {
+            QMutexLocker lock (&observer->_comparisonsLock);
+            for (Identity const & id : ids) {
+                auto iter = observer->_identityLookups.find(id);
+                if (iter == end(observer->_identityLookups))
+                    continue;
+                for (quint32 slot : iter->second)
+                    hits.emplace_back(slot, SeenFlags::TagEquality);
+                observer->_identityLookups.erase(iter);
+                globalEngine->_identityLookupCount--;
+            }
+        }
+
+        if (hits.empty() or observer->isBlinded())
+            continue;
+
+        if (observer->isIncremental())
+            observer->invalidatePartially(hits);
+        else
+            observer->markBlind();
+    }
+}
+
+
+void Observer::forgetSlots (std::vector<quint32> const & slots) {
+    QReadLocker observersLock (&globalEngine->_observersLock);
+
+    // The slots are about to be handed out to new nodes.  Whatever anyone
+    // saw about the old ones must not be mistaken for having seen the new
+    // ones--in particular, an observer's table must not think it already
+    // has flags recorded and skip telling the reverse index about them.
+    std::vector<std::pair<Observer *, quint32>> stale;
+    for (quint32 slot : slots) {
+        auto & stripe = globalEngine->interestStripe(slot);
+        QMutexLocker lock (&stripe._lock);
+
+        auto list = globalEngine->maybeInterests(slot);
+        if (not list)
+            continue;
+        for (Interest const & interest : *list)
+            stale.emplace_back(interest._observer, slot);
+        list->clear();
+    }
+
+    for (auto & entry : stale) {
+        Observer & observer = *entry.first;
+        {
+            QWriteLocker lock (&observer._tableLock);
+
+            size_t const page = entry.second / pageSize;
+            if (page < observer._pages.size() and observer._pages[page])
+                (*observer._pages[page])[entry.second % pageSize] = 0;
+        }
+        QMutexLocker lock (&observer._comparisonsLock);
+        observer._comparisons.erase(entry.second);
+    }
+}
+
 
 void Observer::setTag (
     NodePrivate const & thisNode,
@@ -478,14 +1222,7 @@ void Observer::setTag (
 ) {
     Q_UNUSED(tag);
 
-    globalEngine->forAllObservers([&](Observer & observer) {
-        if (observer.isBlinded())
-            return;
-        if (observer.maybeObserved(thisNode, SeenFlags::Tag)) {
-            observer.markBlind();
-            return;
-        }
-    });
+    invalidate({{&thisNode, SeenFlags::Tag | SeenFlags::TagEquality}}, thisNode);
 }
 
 
@@ -497,47 +1234,32 @@ void Observer::insertChildAsFirstInLabel (
 ) {
     Q_UNUSED(label);
 
-    globalEngine->forAllObservers([&](Observer & observer) {
-
-        if (observer.isBlinded())
-            return;
-
-        if (observer.maybeObserved(newChild,
+    std::vector<Invalidation> changes {
+        {
+            &newChild,
             SeenFlags::HasParent
             | SeenFlags::Parent
             | SeenFlags::LabelInParent
-        )) {
-            observer.markBlind();
-            return;
-        }
-
-        if (observer.maybeObserved(thisNode, SeenFlags::FirstChild)) {
-            observer.markBlind();
-            return;
-        }
-
-        if (nextChildInLabel) {
-            if (observer.maybeObserved(
-                *nextChildInLabel,
-                SeenFlags::HasPreviousSiblingInLabel
-            )) {
-                observer.markBlind();
-                return;
-            }
+            | SeenFlags::ParentEquality
+            | SeenFlags::LabelInParentEquality
+        },
+        {&thisNode, SeenFlags::FirstChild | SeenFlags::Children}
+    };
+
+    if (nextChildInLabel) {
+        changes.emplace_back(
+            nextChildInLabel, SeenFlags::HasPreviousSiblingInLabel
+        );
+        changes.emplace_back(&thisNode, SeenFlags::HasNextSiblingInLabel);
+    } else {
+        changes.emplace_back(&thisNode, SeenFlags::HasLabel);
+    }
 
-            if (observer.maybeObserved(thisNode, SeenFlags::HasNextSiblingInLabel)) {
-                observer.markBlind();
-                return;
-            }
-        } else {
-            if (observer.maybeObserved(thisNode, SeenFlags::HasLabel)) {
-                observer.markBlind();
-                return;
-            }
-        }
-    });
+    // The new child was the root of a tree of its own until now
+    invalidate(changes, thisNode, &newChild);
 }
 
+
 void Observer::insertChildAsLastInLabel (
     NodePrivate const & thisNode,
     NodePrivate const & newChild,
@@ -546,46 +1268,29 @@ void Observer::insertChildAsLastInLabel (
 ) {
     Q_UNUSED(label);
 
-    globalEngine->forAllObservers([&](Observer & observer) {
-
-        if (observer.isBlinded())
-            return;
-
-        if (observer.maybeObserved(newChild,
+    std::vector<Invalidation> changes {
+        {
+            &newChild,
             SeenFlags::HasParent
             | SeenFlags::Parent
             | SeenFlags::LabelInParent
-        )) {
-            observer.markBlind();
-            return;
-        }
-
-        if (observer.maybeObserved(thisNode, SeenFlags::LastChild)) {
-            observer.markBlind();
-            return;
-        }
-
-        if (previousChildInLabel) {
-            if (observer.maybeObserved(*previousChildInLabel,
-                SeenFlags::HasNextSiblingInLabel
-            )) {
-                observer.markBlind();
-                return;
-            }
+            | SeenFlags::ParentEquality
+            | SeenFlags::LabelInParentEquality
+        },
+        {&thisNode, SeenFlags::LastChild | SeenFlags::Children}
+    };
+
+    if (previousChildInLabel) {
+        changes.emplace_back(
+            previousChildInLabel, SeenFlags::HasNextSiblingInLabel
+        );
+        changes.emplace_back(&newChild, SeenFlags::HasPreviousSiblingInLabel);
+    } else {
+        changes.emplace_back(&thisNode, SeenFlags::HasLabel);
+    }
 
-            if (observer.maybeObserved(newChild, 
-                SeenFlags::HasPreviousSiblingInLabel
-            )) {
-                observer.markBlind();
-                return;
-            }
-        } else {
-            if (observer.maybeObserved(thisNode, SeenFlags::HasLabel)) {
-                observer.markBlind();
-                return;
-            }
-        }
-    });
+    // The new child was the root of a tree of its own until now
+    invalidate(changes, thisNode, &newChild);
 }
 
 
@@ -595,47 +1300,33 @@ void Observer::insertChildBetween (
     NodePrivate const & previousChild,
     NodePrivate const & nextChild
 ) {
-    Q_UNUSED(thisNode);
-
     // use the insertChildAsFirstInLabel or insertChildAsLastInLabel
     // invalidations if applicable!
 
-    globalEngine->forAllObservers([&](Observer & observer) {
-
-        if (observer.isBlinded())
-            return;
-
-        if (observer.maybeObserved(newChild,
+    invalidate({
+        {
+            &newChild,
             SeenFlags::HasParent
             | SeenFlags::Parent
             | SeenFlags::LabelInParent
-        )) {
-            observer.markBlind();
-            return;
-        }
+            | SeenFlags::ParentEquality
+            | SeenFlags::LabelInParentEquality
+        },
 
         // previous and next have same status for has next sibling...
         // but the sibling is changing
-        if (observer.maybeObserved(newChild,
+        {
+            &newChild,
             SeenFlags::NextSiblingInLabel
             | SeenFlags::HasNextSiblingInLabel
             | SeenFlags::PreviousSiblingInLabel
             | SeenFlags::HasNextSiblingInLabel
-        )) {
-            observer.markBlind();
-            return;
-        }
+        },
 
-        if (observer.maybeObserved(previousChild, SeenFlags::NextSiblingInLabel)) {
-            observer.markBlind();
-            return;
-        }
-
-        if (observer.maybeObserved(nextChild, SeenFlags::PreviousSiblingInLabel)) {
-            observer.markBlind();
-            return;
-        }
-    });
+        {&previousChild, SeenFlags::NextSiblingInLabel},
+        {&nextChild, SeenFlags::PreviousSiblingInLabel},
+        {&thisNode, SeenFlags::Children}
+    }, thisNode, &newChild);
 }
 
 
@@ -646,81 +1337,48 @@ void Observer::detach (
     NodePrivate const * nextChild,
     NodePrivate const * replacement
 ) {
-    globalEngine->forAllObservers([&](Observer & observer) {
-
-        if (observer.isBlinded())
-            return;
-
-        if (observer.maybeObserved(thisNode,
-            SeenFlags::HasParent
-            | SeenFlags::Parent
-            | SeenFlags::LabelInParent
-            | SeenFlags::NextSiblingInLabel
-            | SeenFlags::PreviousSiblingInLabel
-        )) {
-            observer.markBlind();
-            return;
+    SeenFlags const relationship = SeenFlags::HasParent
+        | SeenFlags::Parent
+        | SeenFlags::LabelInParent
+        | SeenFlags::ParentEquality
+        | SeenFlags::LabelInParentEquality
+        | SeenFlags::NextSiblingInLabel
+        | SeenFlags::PreviousSiblingInLabel;
+
+    std::vector<Invalidation> changes {
+        {&thisNode, relationship},
+        {&parent, SeenFlags::Children}
+    };
+
+    if (replacement)
+        changes.emplace_back(replacement, relationship);
+
+    if (previousChild) {
+        changes.emplace_back(previousChild, SeenFlags::NextSiblingInLabel);
+
+        if ((not replacement) and (not nextChild)) {
+            changes.emplace_back(
+                previousChild, SeenFlags::HasNextSiblingInLabel
+            );
         }
+    } else {
+        // first child is changing...
+        changes.emplace_back(&parent, SeenFlags::FirstChild);
+    }
 
-        if (replacement) {
-            if (observer.maybeObserved(*replacement,
-                SeenFlags::HasParent
-                | SeenFlags::Parent
-                | SeenFlags::LabelInParent
-                | SeenFlags::NextSiblingInLabel
-                | SeenFlags::PreviousSiblingInLabel
-            )) {
-                observer.markBlind();
-                return;
-            }
-        }
-        if (previousChild) {
-            if (observer.maybeObserved(*previousChild, 
-                SeenFlags::NextSiblingInLabel
-            )) {
-                observer.markBlind();
-                return;
-            }
+    if (nextChild) {
+        changes.emplace_back(nextChild, SeenFlags::PreviousSiblingInLabel);
 
-            if (
-                (not replacement)
-                and (not nextChild)
-                and observer.maybeObserved(*previousChild,
-                    SeenFlags::HasNextSiblingInLabel
-                )
-            ) {
-                observer.markBlind();
-                return;
-            }
-        } else {
-            // first child is changing...
-            if (observer.maybeObserved(parent, SeenFlags::FirstChild)) {
-                observer.markBlind();
-                return;
-            }
-        }
-        if (nextChild) {
-            if (observer.maybeObserved(*nextChild, SeenFlags::PreviousSiblingInLabel)) {
-                observer.markBlind();
-                return;
-            }
+        if ((not replacement) and (not previousChild))
+            changes.emplace_back(nextChild, SeenFlags::HasNextSiblingInLabel);
+    } else {
+        // last child is changing...
+        changes.emplace_back(&parent, SeenFlags::LastChild);
+    }
 
-            if (
-                (not replacement)
-                and (not previousChild)
-                and observer.maybeObserved(*nextChild, SeenFlags::HasNextSiblingInLabel)
-            ) {
-                observer.markBlind();
-                return;
-            }
-        } else {
-            // last child is changing...
-            if (observer.maybeObserved(parent, SeenFlags::LastChild)) {
-                observer.markBlind();
-                return;
-            }
-        }
-    });
+    // The detached node heads a tree of its own now, and a replacement
+    // headed one until now
+    invalidate(changes, parent, replacement, &thisNode);
 }
 
 
@@ -730,22 +1388,19 @@ void Observer::setText (
 ) {
     Q_UNUSED(str);
 
-    globalEngine->forAllObservers([&](Observer & observer) {
-
-        if (observer.isBlinded())
-            return;
-
-        if (observer.maybeObserved(thisNode, SeenFlags::Data)) {
-            observer.markBlind();
-            return;
-        }
-    });
+    invalidate({{&thisNode, SeenFlags::Data}}, thisNode);
 }
 
 
 Observer::~Observer() {
     QWriteLocker lock (&globalEngine->_observersLock);
     globalEngine->_observers.erase(this);
+
+    forgetInterests();
+
+    QMutexLocker dirtyLock (&globalEngine->_dirtyLock);
+    auto & dirty = globalEngine->_dirtyObservers;
+    dirty.erase(std::remove(begin(dirty), end(dirty), this), end(dirty));
 }
 
 } // end namespace methyl
@@ -0,0 +1,89 @@
+//
+// parallel.cpp
+// This file is part of Methyl
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Methyl is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Methyl is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Methyl.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://methyl.hostilefork.com/ for more information on this project
+//
+
+#include <QThreadPool>
+
+#include "methyl/parallel.h"
+
+namespace methyl {
+
+namespace {
+
+// More pieces than threads, so a thread that finishes a small subtree can
+// pick up another piece instead of idling while others finish big ones
+int const piecesPerThread = 8;
+
+// How many levels may be opened up looking for the tree to fan out.  Each
+// opened node becomes a piece of its own, so without a limit a long chain
+// would be split into one piece per link.
+int const maxOpenedLevels = 32;
+
+} // end anonymous namespace
+
+
+std::vector<ParallelPiece> splitForParallel (
+    NodeView<Accessor const> const & root
+) {
+    size_t const target = static_cast<size_t>(
+        std::max(1, QThreadPool::globalInstance()->maxThreadCount())
+    ) * piecesPerThread;
+
+    std::vector<ParallelPiece> opened;
+    std::vector<NodeView<Accessor const>> frontier {root};
+
+    // Open up one level at a time; stop as soon as there are enough pieces,
+    // there are no children left to open up, or it has gone deep enough.
+    for (int level = 0; level < maxOpenedLevels; level++) {
+        if (frontier.size() >= target)
+            break;
+
+        std::vector<NodeView<Accessor const>> next;
+        bool anyChildren = false;
+
+        for (NodeView<Accessor const> const & node : frontier) {
+            for (Label const & label : node->labels()) {
+                for (auto const & child : node->childrenInLabel(label)) {
+                    next.push_back(child);
+                    anyChildren = true;
+                }
+            }
+        }
+
+        if (not anyChildren)
+            break;
+
+        for (NodeView<Accessor const> const & node : frontier)
+            opened.push_back(ParallelPiece {node, false, 0});
+        frontier = std::move(next);
+    }
+
+    std::vector<ParallelPiece> result = std::move(opened);
+    result.reserve(result.size() + frontier.size());
+    for (NodeView<Accessor const> const & node : frontier)
+        result.push_back(ParallelPiece {node, true, 0});
+
+    for (size_t index = 0; index < result.size(); index++)
+        result[index]._index = index;
+
+    return result;
+}
+
+} // end namespace methyl